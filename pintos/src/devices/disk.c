@@ -60,6 +60,10 @@ struct disk
 
     long long read_cnt;         /* Number of sectors read. */
     long long write_cnt;        /* Number of sectors written. */
+    long long read_cmd_cnt;     /* Number of read commands issued. */
+    long long write_cmd_cnt;    /* Number of write commands issued. */
+    disk_sector_t head;         /* Sector just past the last transfer. */
+    long long seek_dist;        /* Total sectors the head has moved. */
   };
 
 /* An ATA channel (aka controller).
@@ -86,7 +90,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -140,6 +144,9 @@ disk_init (void)
           d->capacity = 0;
 
           d->read_cnt = d->write_cnt = 0;
+          d->read_cmd_cnt = d->write_cmd_cnt = 0;
+          d->head = 0;
+          d->seek_dist = 0;
         }
 
       /* Register interrupt handler. */
@@ -173,8 +180,11 @@ disk_print_stats (void)
         {
           struct disk *d = disk_get (chan_no, dev_no);
           if (d != NULL && d->is_ata) 
-            printf ("%s: %lld reads, %lld writes\n",
-                    d->name, d->read_cnt, d->write_cnt);
+            printf ("%s: %lld reads in %lld commands, "
+                    "%lld writes in %lld commands, "
+                    "%lld sectors of head travel\n",
+                    d->name, d->read_cnt, d->read_cmd_cnt,
+                    d->write_cnt, d->write_cmd_cnt, d->seek_dist);
         }
     }
 }
@@ -218,49 +228,114 @@ disk_size (struct disk *d)
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) 
+{
+  disk_read_multiple (d, sec_no, 1, &buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   DISK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
+{
+  disk_write_multiple (d, sec_no, 1, &buffer);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D, sector
+   SEC_NO + I into BUFFERS[I], each of which must have room for
+   DISK_SECTOR_SIZE bytes.  Issues one READ SECTOR command for up
+   to DISK_MULTIPLE_MAX sectors at a time, instead of one per
+   sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                    void *const buffers[]) 
 {
   struct channel *c;
   
   ASSERT (d != NULL);
-  ASSERT (buffer != NULL);
+  ASSERT (buffers != NULL);
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  d->read_cnt++;
+  while (cnt > 0) 
+    {
+      size_t n = cnt < DISK_MULTIPLE_MAX ? cnt : DISK_MULTIPLE_MAX;
+      size_t i;
+
+      select_sector (d, sec_no, n);
+      issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+      d->read_cmd_cnt++;
+
+      /* The disk interrupts once for each sector, when it has
+         the sector ready in its data register. */
+      for (i = 0; i < n; i++) 
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          ASSERT (buffers[i] != NULL);
+          input_sector (c, buffers[i]);
+          d->read_cnt++;
+        }
+      sec_no += n;
+      buffers += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   DISK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D, sector
+   SEC_NO + I from BUFFERS[I], each of which must contain
+   DISK_SECTOR_SIZE bytes.  Issues one WRITE SECTOR command for
+   up to DISK_MULTIPLE_MAX sectors at a time, instead of one per
+   sector.  Returns after the disk has acknowledged receiving the
+   data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 void
-disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
+disk_write_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                     const void *const buffers[])
 {
   struct channel *c;
   
   ASSERT (d != NULL);
-  ASSERT (buffer != NULL);
+  ASSERT (buffers != NULL);
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  d->write_cnt++;
+  while (cnt > 0) 
+    {
+      size_t n = cnt < DISK_MULTIPLE_MAX ? cnt : DISK_MULTIPLE_MAX;
+      size_t i;
+
+      select_sector (d, sec_no, n);
+      issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+      d->write_cmd_cnt++;
+
+      /* The disk asks for each sector in turn and interrupts once
+         it has taken it. */
+      for (i = 0; i < n; i++) 
+        {
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          ASSERT (buffers[i] != NULL);
+          output_sector (c, buffers[i]);
+          sema_down (&c->completion_wait);
+          d->write_cnt++;
+        }
+      sec_no += n;
+      buffers += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
-
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -426,18 +501,24 @@ print_ata_string (char *string, size_t size)
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection
+   registers, to transfer the CNT sectors starting at SEC_NO.
+   (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) 
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) 
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < d->capacity);
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= DISK_MULTIPLE_MAX);
+  ASSERT (sec_no < d->capacity && cnt <= d->capacity - sec_no);
+  ASSERT (sec_no + cnt <= (1UL << 28));
+
+  /* Account for the distance a real head would seek to get here. */
+  d->seek_dist += (sec_no > d->head ? sec_no - d->head : d->head - sec_no);
+  d->head = sec_no + cnt;
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt);   /* 256 wraps to 0, which means 256. */
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
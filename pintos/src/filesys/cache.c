@@ -1,220 +1,1134 @@
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
 #include "threads/thread.h"
 #include "threads/synch.h"
+#include "threads/init.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
 #include <debug.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define BUFFER_SIZE 32
+#define CACHE_MIN_SECTORS 32           /* Smallest cache allowed. */
+#define CACHE_RAM_FRACTION 64          /* Default: 1/64th of RAM. */
+#define SECTORS_PER_PAGE (PGSIZE / DISK_SECTOR_SIZE)
+#define AHEAD_QUEUE_MAX 64              /* Most pending read-ahead requests. */
+#define RUN_MAX 16                      /* Most sectors moved by one disk transfer. */
+#define A1IN_MAX (cache_cnt / 4)        /* 2Q: target size of the A1in queue. */
+#define GHOST_SIZE (cache_cnt / 2)      /* 2Q: sectors remembered in A1out. */
+
+/* Which 2Q queue a slot is on.  Unused slots are on free_slots. */
+enum cache_queue
+{
+	Q_FREE,                             /* Unused. */
+	Q_NONE,                             /* In use, clock policy. */
+	Q_A1IN,                             /* 2Q: seen once, FIFO. */
+	Q_AM                                /* 2Q: seen again, LRU. */
+};
+
+/* A cache slot.
+
+   cache_lock protects every member except the contents of
+   buffer, and is never held across disk I/O.  While a slot's
+   sector is being read in it is marked loading and nobody may
+   touch its data; while it is being written back it is marked
+   flushing and only readers may.  Conversely a slot is not
+   written back while anyone has it pinned for writing, and not
+   evicted while anyone has it pinned at all.  Threads that have
+   to wait for any of these to end wait on the slot's io_done.
+   A slot held for the journal is neither written back nor
+   evicted until the journal has logged it and lets it go. */
 struct buffer_cache
 {
 	bool used;
 	bool dirty;
 	bool clock_bit;
+	bool meta_chance;                   /* Metadata: skip one more clock sweep. */
+	bool loading;                       /* disk_read() into buffer in progress. */
+	bool flushing;                      /* disk_write() from buffer in progress. */
+	bool prefetched;                    /* Read ahead, not yet used. */
+	bool held;                          /* In an uncommitted journal transaction. */
+	int pin_cnt;                        /* Number of cache_get()s not yet put. */
+	int write_cnt;                      /* Of those, the ones with CACHE_WRITE. */
+	struct condition io_done;           /* Signaled when a slot becomes idle. */
 
 	disk_sector_t disk_sector;
-	uint8_t buffer[DISK_SECTOR_SIZE];
+	struct hash_elem hash_elem;         /* Element in cache_map while used. */
+	enum cache_queue queue;             /* List that q_elem is on, if any. */
+	struct list_elem q_elem;            /* free_slots, a1in or am element. */
+	uint8_t *buffer;                    /* DISK_SECTOR_SIZE bytes of data. */
 };
 
+/* A sector recently dropped from A1in, remembered by 2Q so that
+   a quick second reference goes straight to Am. */
+struct ghost_entry
+{
+	bool used;
+	disk_sector_t disk_sector;
+	struct hash_elem hash_elem;         /* Element in ghost_map while used. */
+};
+
+/* A request to read ahead SECTOR_CNT sectors from DISK_SECTOR
+   on. */
 struct ahead_entry
 {
 	disk_sector_t disk_sector;
+	size_t sector_cnt;
 	struct list_elem ahead_elem;
 };
 
-static struct buffer_cache cache[BUFFER_SIZE];
+/* The slots and their data, CACHE_CNT of each, set up by
+   cache_init().  The data comes from the kernel pool, one page
+   per SECTORS_PER_PAGE slots. */
+static struct buffer_cache *cache;
+static uint8_t *cache_data;
+static size_t cache_cnt;
+/* Maps a sector number to the slot holding it, so a lookup does
+   not have to walk every slot of cache[]. */
+static struct hash cache_map;
 static struct lock cache_lock;
-static struct condition cond_ahead;
-static struct lock cond_lock;
+static struct condition cond_ahead;     /* Signaled when ahead_list grows. */
+static struct condition cond_idle;      /* Signaled when any slot becomes idle. */
 static struct list ahead_list;
-static bool close_ahead = true;
-static uint8_t clock;
+static size_t ahead_cnt;
+static unsigned clock;
+static struct list free_slots;          /* Slots never used yet. */
+
+/* 2Q state.  New sectors enter a1in, a FIFO that a single scan
+   can flush without disturbing anything else.  Sectors that are
+   referenced again after falling out of a1in, while their number
+   is still remembered in the ghost ring (A1out), and metadata,
+   go to am, an LRU list of the working set.  Front is newest. */
+static struct list a1in;
+static struct list am;
+static size_t a1in_cnt;
+static struct ghost_entry *ghosts;      /* GHOST_SIZE entries. */
+static unsigned ghost_next;             /* Oldest ghost, replaced next. */
+static struct hash ghost_map;
+
+/* Statistics, protected by cache_lock like everything else they
+   count.  Hits and misses are demand lookups only: reads issued
+   by the read-ahead thread are counted as ahead_cnt instead, and
+   as ahead_used_cnt once a demand lookup hits them. */
+static long long cache_hit_cnt, cache_miss_cnt;
+static long long cache_evict_cnt;       /* Sectors replaced. */
+static long long cache_writeback_cnt;   /* Dirty sectors written to disk. */
+static long long cache_ahead_cnt;       /* Sectors read ahead. */
+static long long cache_ahead_used_cnt;  /* Of those, later hit. */
+
+/* Replacement policy.  Controlled by kernel command-line option
+   "-cache". */
+enum cache_policy cache_policy = CACHE_CLOCK;
+
+/* If false (default), writes only dirty the cached sector, which
+   reaches disk when it is evicted or the cache is closed.
+   If true, every write also goes straight to disk.
+   Controlled by kernel command-line option "-wt". */
+bool cache_write_through;
+
+/* Timer ticks between passes of the write-behind thread, which
+   bounds how long a sector may stay dirty.  0 disables the
+   thread.  Controlled by kernel command-line option "-flush". */
+int64_t cache_flush_ticks = TIMER_FREQ;
+
+/* Number of sectors to cache, or 0 to use 1/CACHE_RAM_FRACTION
+   of RAM.  Rounded up to fill whole pages.  Controlled by kernel
+   command-line option "-cache-size". */
+size_t cache_sectors;
+
+/* Dirty slots collected by cache_flush_dirty(), in sector order.
+   cache_flush_run() drops cache_lock for its writes, so a pass
+   holds flush_lock, taken before cache_lock, from start to end
+   to keep the next pass from overwriting the array under it. */
+static struct buffer_cache **flush_order;
+static struct lock flush_lock;
 
 
-void cache_read_ahead(void *aux);
 void cache_init(void);
 void cache_close(void);
 void cache_write(struct disk *d, disk_sector_t sec_no, const void *buffer);
 void cache_read(struct disk *d, disk_sector_t sec_no, void *buffer);
-int cache_evict(struct disk *d);
-void cache_flush(uint8_t evict_no,struct disk *d);
+void cache_read_at(struct disk *d, disk_sector_t sec_no, void *buffer, size_t ofs, size_t size);
+void cache_write_at(struct disk *d, disk_sector_t sec_no, const void *buffer, size_t ofs, size_t size);
+void cache_read_ahead(struct disk *d, disk_sector_t sec_no, size_t cnt);
+void cache_print_stats(void);
+void *cache_get(struct disk *d, disk_sector_t sec_no, enum cache_flags flags);
+void cache_put(void *buffer, bool dirty);
+void cache_release(const disk_sector_t *sectors, size_t cnt);
+size_t cache_flush_sectors(struct disk *d, const disk_sector_t *sectors, size_t cnt);
+struct buffer_cache *cache_evict(struct disk *d, bool wait);
+void cache_flush(struct buffer_cache *b, struct disk *d);
 
-void
-cache_read_ahead(void *aux UNUSED)
+static unsigned cache_hash(const struct hash_elem *e, void *aux UNUSED);
+static bool cache_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED);
+static struct buffer_cache *cache_lookup(disk_sector_t sec_no);
+static struct buffer_cache *cache_fetch(struct disk *d, disk_sector_t sec_no, enum cache_flags flags, bool wait);
+static struct buffer_cache *cache_load(struct disk *d, disk_sector_t sec_no, enum cache_flags flags, bool wait);
+static size_t cache_load_run(struct disk *d, disk_sector_t sec_no, size_t cnt, struct buffer_cache **slots);
+static size_t cache_flush_run(struct buffer_cache **slots, size_t cnt, struct disk *d);
+static size_t run_limit(size_t cnt);
+static bool cache_flushable(const struct buffer_cache *b);
+static void cache_unpin(struct buffer_cache *b);
+static void cache_install(struct buffer_cache *b, disk_sector_t sec_no, enum cache_flags flags);
+static bool cache_idle(const struct buffer_cache *b);
+static void policy_insert(struct buffer_cache *b, enum cache_flags flags);
+static void policy_touch(struct buffer_cache *b, enum cache_flags flags);
+static void policy_remove(struct buffer_cache *b);
+static struct buffer_cache *clock_victim(void);
+static struct buffer_cache *queue_victim(struct list *q);
+static struct buffer_cache *twoq_victim(void);
+static unsigned ghost_hash(const struct hash_elem *e, void *aux UNUSED);
+static bool ghost_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED);
+static void ghost_add(disk_sector_t sec_no);
+static bool ghost_remove(disk_sector_t sec_no);
+static void cache_io_done(struct buffer_cache *b);
+static int cache_sector_cmp(const void *a, const void *b);
+static void cache_flush_dirty(void);
+static void cache_write_behind(void *aux UNUSED);
+static void cache_ahead_thread(void *aux UNUSED);
+
+/* Hash function for cache_map: the sector number itself. */
+static unsigned
+cache_hash(const struct hash_elem *e, void *aux UNUSED)
 {
-	cond_init(&cond_ahead);
-	lock_init(&cond_lock);
-	
-	while(!close_ahead)
+	const struct buffer_cache *b = hash_entry(e, struct buffer_cache, hash_elem);
+	return hash_int(b->disk_sector);
+}
+
+/* Orders cache_map entries by sector number. */
+static bool
+cache_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+	const struct buffer_cache *x = hash_entry(a, struct buffer_cache, hash_elem);
+	const struct buffer_cache *y = hash_entry(b, struct buffer_cache, hash_elem);
+	return x->disk_sector < y->disk_sector;
+}
+
+/* Returns the slot caching SEC_NO, or a null pointer if the
+   sector is not in the cache. */
+static struct buffer_cache *
+cache_lookup(disk_sector_t sec_no)
+{
+	struct buffer_cache key;
+	struct hash_elem *e;
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+	key.disk_sector = sec_no;
+	e = hash_find(&cache_map, &key.hash_elem);
+	return e != NULL ? hash_entry(e, struct buffer_cache, hash_elem) : NULL;
+}
+
+/* Returns a slot holding SEC_NO whose data may be accessed, with
+   cache_lock held.  With CACHE_WRITE, a write-back in progress
+   is waited out before returning.  With CACHE_NEW, the caller is
+   about to overwrite the whole sector, so on a miss the old
+   contents are not read.
+
+   cache_lock is dropped while waiting and while reading the
+   sector in, so a miss only blocks threads that want the same
+   sector; they wait for the one disk_read() instead of issuing
+   their own.
+
+   If WAIT is false and SEC_NO is not cached, returns a null
+   pointer instead of waiting for a slot to become idle, for a
+   caller that has other slots pinned. */
+static struct buffer_cache *
+cache_fetch(struct disk *d, disk_sector_t sec_no, enum cache_flags flags, bool wait)
+{
+	struct buffer_cache *b;
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+	for(;;)
 	{
-		lock_acquire(&cond_lock);
-		cond_wait(&cond_ahead, &cond_lock);
-		lock_acquire(&cache_lock);
-		
-		while(!list_empty(&ahead_list))	
-		{	
-			struct list_elem *temp = list_pop_front(&ahead_list);
-			struct ahead_entry *temp_ahead = list_entry(temp, struct ahead_entry, ahead_elem); 
-				
-			int evict_no = cache_evict(filesys_disk);
-			disk_read(filesys_disk, temp_ahead->disk_sector, cache[evict_no].buffer);
-			cache[evict_no].disk_sector = temp_ahead->disk_sector;
-			cache[evict_no].used = true;
-			cache[evict_no].clock_bit = true;
-
-		
+		b = cache_lookup(sec_no);
+		if(b != NULL)
+		{
+			if(b->loading || ((flags & CACHE_WRITE) && b->flushing))
+			{
+				cond_wait(&b->io_done, &cache_lock);
+				continue;
+			}
+			cache_hit_cnt++;
+			if(b->prefetched)
+			{
+				cache_ahead_used_cnt++;
+				b->prefetched = false;
+			}
+			policy_touch(b, flags);
+			return b;
 		}
 
+		b = cache_load(d, sec_no, flags, wait);
+		if(b != NULL)
+		{
+			cache_miss_cnt++;
+			return b;
+		}
+		if(!wait && cache_lookup(sec_no) == NULL)
+			return NULL;
+	}
+}
+
+/* Puts SEC_NO, which was not cached, into an evicted slot and
+   reads it in unless FLAGS has CACHE_NEW.  Returns the slot, or
+   a null pointer if another thread brought SEC_NO in while
+   cache_evict() was writing back the victim or, if WAIT is
+   false, if no slot is idle. */
+static struct buffer_cache *
+cache_load(struct disk *d, disk_sector_t sec_no, enum cache_flags flags, bool wait)
+{
+	struct buffer_cache *b;
+
+	b = cache_evict(d, wait);
+	if(b == NULL || cache_lookup(sec_no) != NULL)
+		return NULL;
+
+	cache_install(b, sec_no, flags);
+	if(!(flags & CACHE_NEW))
+	{
+		b->loading = true;
 		lock_release(&cache_lock);
+		disk_read(d, sec_no, b->buffer);
+		lock_acquire(&cache_lock);
+		b->loading = false;
+		cache_io_done(b);
+	}
+	return b;
+}
+
+/* Brings the CNT sectors starting at SEC_NO, the first of which
+   is not cached, into evicted slots with a single disk read, and
+   stores the slots, pinned, in SLOTS.  Stops short at the first
+   sector that turns out to be cached already, or at run_limit()
+   sectors, or when no slot is idle for the next sector: only the
+   first slot, taken before any is pinned, is waited for, since
+   runs waiting for slots while holding others pinned could
+   deadlock.  Returns the number of sectors read, which is 0 if
+   another thread brought SEC_NO itself in while cache_evict()
+   was writing back a victim.  Drops cache_lock for the read;
+   threads that want one of the sectors meanwhile wait for it. */
+static size_t
+cache_load_run(struct disk *d, disk_sector_t sec_no, size_t cnt, struct buffer_cache **slots)
+{
+	void *bufs[RUN_MAX];
+	struct buffer_cache *b;
+	size_t n, i;
 
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+	cnt = run_limit(cnt);
+	for(n=0; n<cnt; n++)
+	{
+		if(cache_lookup(sec_no + n) != NULL)
+			break;
+		b = cache_evict(d, n == 0);
+		if(b == NULL || cache_lookup(sec_no + n) != NULL)
+			break;
+		cache_install(b, sec_no + n, 0);
+		b->loading = true;
+		b->pin_cnt++;
+		slots[n] = b;
+		bufs[n] = b->buffer;
+	}
+	if(n == 0)
+		return 0;
 
-		lock_release(&cond_lock);
+	lock_release(&cache_lock);
+	disk_read_multiple(d, sec_no, n, bufs);
+	lock_acquire(&cache_lock);
+	for(i=0; i<n; i++)
+	{
+		slots[i]->loading = false;
+		cache_io_done(slots[i]);
 	}
+	return n;
+}
 
+/* Returns CNT, cut down to the number of sectors that one run
+   may pin at once, no more than a quarter of the cache.  This
+   only keeps a run from crowding out other threads; what keeps
+   runs from deadlocking is that none waits for a slot while it
+   has others pinned. */
+static size_t
+run_limit(size_t cnt)
+{
+	size_t max = cache_cnt / 4 < RUN_MAX ? cache_cnt / 4 : RUN_MAX;
+	return cnt < max ? cnt : max;
+}
+
+/* Unpins slot B, pinned by cache_load_run(). */
+static void
+cache_unpin(struct buffer_cache *b)
+{
+	ASSERT(b->pin_cnt > 0);
+	if(--b->pin_cnt == 0)
+		cache_io_done(b);
 }
 
+/* Makes clean, idle slot B, just returned by cache_evict(), hold
+   sector SEC_NO and indexes it under that sector. */
+static void
+cache_install(struct buffer_cache *b, disk_sector_t sec_no, enum cache_flags flags)
+{
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+	ASSERT(!b->dirty && cache_idle(b));
+	if(b->used)
+	{
+		cache_evict_cnt++;
+		policy_remove(b);
+		hash_delete(&cache_map, &b->hash_elem);
+	}
+	else
+		list_remove(&b->q_elem);
+	b->disk_sector = sec_no;
+	b->used = true;
+	b->prefetched = false;
+	b->held = false;
+	hash_insert(&cache_map, &b->hash_elem);
+	policy_insert(b, flags);
+}
+
+/* Returns true if B may be evicted: nobody has it pinned, no
+   I/O on it is in flight and the journal does not hold it. */
+static bool
+cache_idle(const struct buffer_cache *b)
+{
+	return !b->loading && !b->flushing && b->pin_cnt == 0 && !b->held;
+}
+
+/* Replacement policy bookkeeping for B, which has just been
+   given a new sector accessed with FLAGS. */
+static void
+policy_insert(struct buffer_cache *b, enum cache_flags flags)
+{
+	b->clock_bit = true;
+	b->meta_chance = (flags & CACHE_META) != 0;
+	b->queue = Q_NONE;
+	if(cache_policy == CACHE_2Q)
+	{
+		if((flags & CACHE_META) || ghost_remove(b->disk_sector))
+		{
+			b->queue = Q_AM;
+			list_push_front(&am, &b->q_elem);
+		}
+		else
+		{
+			b->queue = Q_A1IN;
+			list_push_front(&a1in, &b->q_elem);
+			a1in_cnt++;
+		}
+	}
+}
+
+/* Replacement policy bookkeeping for a hit on B with FLAGS.
+   Under 2Q a hit in A1in is deliberately not promoted: only a
+   reference after the sector has aged out of A1in, or a
+   metadata access, shows it belongs in the working set. */
+static void
+policy_touch(struct buffer_cache *b, enum cache_flags flags)
+{
+	b->clock_bit = true;
+	if(flags & CACHE_META)
+		b->meta_chance = true;
+	if(b->queue == Q_AM || (b->queue == Q_A1IN && (flags & CACHE_META)))
+	{
+		if(b->queue == Q_A1IN)
+			a1in_cnt--;
+		list_remove(&b->q_elem);
+		b->queue = Q_AM;
+		list_push_front(&am, &b->q_elem);
+	}
+}
+
+/* Replacement policy bookkeeping for B losing its sector.  A
+   sector leaving A1in is remembered as a ghost. */
+static void
+policy_remove(struct buffer_cache *b)
+{
+	if(b->queue == Q_A1IN)
+	{
+		a1in_cnt--;
+		ghost_add(b->disk_sector);
+	}
+	if(b->queue == Q_A1IN || b->queue == Q_AM)
+		list_remove(&b->q_elem);
+	b->queue = Q_NONE;
+}
+
+/* Clock policy: sweeps the hand until it finds an idle slot
+   whose reference bit, and for metadata its extra chance, have
+   both run out.  Returns a null pointer if three full sweeps
+   find nothing, which means every slot is busy. */
+static struct buffer_cache *
+clock_victim(void)
+{
+	struct buffer_cache *b;
+	unsigned i;
+
+	for(i=0; i<3 * cache_cnt; i++)
+	{
+		b = &cache[clock];
+		if(clock==cache_cnt-1)
+			clock = 0;
+		else
+			clock++;
+
+		if(!cache_idle(b))
+			continue;
+		if(b->clock_bit)
+			b->clock_bit = false;
+		else if(b->meta_chance)
+			b->meta_chance = false;
+		else
+			return b;
+	}
+	return NULL;
+}
+
+/* Returns the oldest idle slot on 2Q queue Q, or a null pointer
+   if there is none. */
+static struct buffer_cache *
+queue_victim(struct list *q)
+{
+	struct list_elem *e;
+
+	for(e = list_rbegin(q); e != list_rend(q); e = list_prev(e))
+	{
+		struct buffer_cache *b = list_entry(e, struct buffer_cache, q_elem);
+		if(cache_idle(b))
+			return b;
+	}
+	return NULL;
+}
+
+/* 2Q policy: takes from A1in while it is over its target size,
+   so one-time sectors such as a long sequential read cycle
+   through A1in without touching Am, and otherwise from the
+   least recently used end of Am. */
+static struct buffer_cache *
+twoq_victim(void)
+{
+	struct buffer_cache *b;
+
+	if(a1in_cnt > A1IN_MAX && (b = queue_victim(&a1in)) != NULL)
+		return b;
+	if((b = queue_victim(&am)) != NULL)
+		return b;
+	return queue_victim(&a1in);
+}
+
+/* Hash function for ghost_map. */
+static unsigned
+ghost_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+	const struct ghost_entry *g = hash_entry(e, struct ghost_entry, hash_elem);
+	return hash_int(g->disk_sector);
+}
+
+/* Orders ghost_map entries by sector number. */
+static bool
+ghost_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+	const struct ghost_entry *x = hash_entry(a, struct ghost_entry, hash_elem);
+	const struct ghost_entry *y = hash_entry(b, struct ghost_entry, hash_elem);
+	return x->disk_sector < y->disk_sector;
+}
+
+/* Remembers SEC_NO in the ghost ring, forgetting the oldest. */
+static void
+ghost_add(disk_sector_t sec_no)
+{
+	struct ghost_entry *g = &ghosts[ghost_next];
+
+	if(g->used)
+		hash_delete(&ghost_map, &g->hash_elem);
+	g->used = true;
+	g->disk_sector = sec_no;
+	if(hash_insert(&ghost_map, &g->hash_elem) != NULL)
+		g->used = false;
+	ghost_next = (ghost_next + 1) % GHOST_SIZE;
+}
+
+/* Forgets SEC_NO if it is in the ghost ring.  Returns true if it
+   was. */
+static bool
+ghost_remove(disk_sector_t sec_no)
+{
+	struct ghost_entry key;
+	struct hash_elem *e;
+
+	key.disk_sector = sec_no;
+	e = hash_delete(&ghost_map, &key.hash_elem);
+	if(e == NULL)
+		return false;
+	hash_entry(e, struct ghost_entry, hash_elem)->used = false;
+	return true;
+}
+
+/* Wakes up everyone waiting for B, or any slot, to become idle. */
+static void
+cache_io_done(struct buffer_cache *b)
+{
+	cond_broadcast(&b->io_done, &cache_lock);
+	cond_broadcast(&cond_idle, &cache_lock);
+}
+
+/* qsort() comparison that orders slot pointers by sector. */
+static int
+cache_sector_cmp(const void *a, const void *b)
+{
+	const struct buffer_cache *x = *(struct buffer_cache * const *) a;
+	const struct buffer_cache *y = *(struct buffer_cache * const *) b;
+	return x->disk_sector < y->disk_sector ? -1 : x->disk_sector > y->disk_sector;
+}
+
+/* Writes every dirty slot back to disk in ascending sector
+   order, so that runs of adjacent sectors go out together, each
+   in one disk write, instead of one sector at a time in slot
+   order. */
+static void
+cache_flush_dirty(void)
+{
+	size_t cnt = 0;
+	size_t i;
+
+	lock_acquire(&flush_lock);
+	lock_acquire(&cache_lock);
+	for(i=0; i<cache_cnt; i++)
+		if(cache[i].used && cache[i].dirty && !cache[i].held)
+			flush_order[cnt++] = &cache[i];
+	qsort(flush_order, cnt, sizeof *flush_order, cache_sector_cmp);
+	for(i=0; i<cnt; )
+		i += cache_flush_run(flush_order + i, cnt - i, filesys_disk);
+	lock_release(&cache_lock);
+	lock_release(&flush_lock);
+}
+
+/* Write-behind thread: periodically cleans the cache so that
+   eviction rarely has to write a dirty sector on the path of a
+   foreground read. */
+static void
+cache_write_behind(void *aux UNUSED)
+{
+	for(;;)
+	{
+		timer_sleep(cache_flush_ticks);
+		cache_flush_dirty();
+	}
+}
+
+/* Read-ahead thread: loads the runs of sectors queued on
+   ahead_list into the cache, skipping those already cached and
+   reading each stretch of the rest with one disk read.  Goes
+   through cache_load_run(), so the prefetch does not hold
+   cache_lock across the read and a reader that arrives for one
+   of the sectors waits for it instead of reading it again. */
+static void
+cache_ahead_thread(void *aux UNUSED)
+{
+	struct buffer_cache *slots[RUN_MAX];
+
+	lock_acquire(&cache_lock);
+	for(;;)
+	{
+		struct ahead_entry *a;
+		disk_sector_t sec_no;
+		size_t cnt, n, i;
+
+		while(list_empty(&ahead_list))
+			cond_wait(&cond_ahead, &cache_lock);
+		a = list_entry(list_pop_front(&ahead_list), struct ahead_entry, ahead_elem);
+		ahead_cnt--;
+		sec_no = a->disk_sector;
+		cnt = a->sector_cnt;
+		free(a);
+
+		while(cnt > 0)
+		{
+			if(cache_lookup(sec_no) != NULL)
+				n = 1;
+			else
+			{
+				n = cache_load_run(filesys_disk, sec_no, cnt, slots);
+				/* Not referenced yet: let an unused prefetch be
+				   the first thing the clock hand takes back. */
+				for(i=0; i<n; i++)
+				{
+					slots[i]->clock_bit = false;
+					slots[i]->prefetched = true;
+					cache_ahead_cnt++;
+					cache_unpin(slots[i]);
+				}
+			}
+			sec_no += n;
+			cnt -= n;
+		}
+	}
+}
+
+/* Asks the read-ahead thread to bring the CNT sectors starting
+   at SEC_NO into the cache, without waiting for them.  Does
+   nothing if the first sector is already cached or too many
+   requests are pending. */
 void
-cache_ahead_close(void)
+cache_read_ahead(struct disk *d, disk_sector_t sec_no, size_t cnt)
 {
-	close_ahead = true;
-	cond_signal(&cond_ahead, &cond_lock);
+	struct ahead_entry *a;
+
+	if(sec_no >= disk_size(d))
+		return;
+	if(cnt > disk_size(d) - sec_no)
+		cnt = disk_size(d) - sec_no;
+	if(cnt == 0)
+		return;
+
+	lock_acquire(&cache_lock);
+	if(cache_lookup(sec_no) == NULL && ahead_cnt < AHEAD_QUEUE_MAX)
+	{
+		a = malloc(sizeof *a);
+		if(a != NULL)
+		{
+			a->disk_sector = sec_no;
+			a->sector_cnt = cnt;
+			list_push_back(&ahead_list, &a->ahead_elem);
+			ahead_cnt++;
+			cond_signal(&cond_ahead, &cache_lock);
+		}
+	}
+	lock_release(&cache_lock);
 }
 
 void
 cache_init(void)
 {
-	int i;
+	size_t i, pages;
+
+	if(cache_sectors == 0)
+		cache_sectors = ram_pages * SECTORS_PER_PAGE / CACHE_RAM_FRACTION;
+	if(cache_sectors < CACHE_MIN_SECTORS)
+		cache_sectors = CACHE_MIN_SECTORS;
+	pages = DIV_ROUND_UP(cache_sectors, SECTORS_PER_PAGE);
+	cache_cnt = pages * SECTORS_PER_PAGE;
+	cache_data = palloc_get_multiple(0, pages);
+	cache = malloc(cache_cnt * sizeof *cache);
+	flush_order = malloc(cache_cnt * sizeof *flush_order);
+	ghosts = malloc(GHOST_SIZE * sizeof *ghosts);
+	if(cache_data == NULL || cache == NULL || flush_order == NULL || ghosts == NULL)
+		PANIC("cannot allocate a %zu sector buffer cache", cache_cnt);
+
 	lock_init(&cache_lock);
+	lock_init(&flush_lock);
+	cond_init(&cond_ahead);
+	cond_init(&cond_idle);
 	list_init(&ahead_list);
-	close_ahead = false;
+	ahead_cnt = 0;
+	if(!hash_init(&cache_map, cache_hash, cache_less, NULL)
+	   || !hash_init(&ghost_map, ghost_hash, ghost_less, NULL))
+		PANIC("buffer cache index creation failed");
 	clock = 0;
-	for(i=0; i<BUFFER_SIZE; i++)
+	list_init(&free_slots);
+	list_init(&a1in);
+	list_init(&am);
+	a1in_cnt = 0;
+	ghost_next = 0;
+	for(i=0; i<GHOST_SIZE; i++)
+		ghosts[i].used = false;
+	for(i=0; i<cache_cnt; i++)
 	{
 		cache[i].used = false;
 		cache[i].clock_bit = false;
 		cache[i].dirty = false;
+		cache[i].meta_chance = false;
+		cache[i].loading = false;
+		cache[i].flushing = false;
+		cache[i].prefetched = false;
+		cache[i].held = false;
+		cache[i].pin_cnt = 0;
+		cache[i].write_cnt = 0;
+		cond_init(&cache[i].io_done);
+		cache[i].buffer = cache_data + i * DISK_SECTOR_SIZE;
+		cache[i].queue = Q_FREE;
+		list_push_back(&free_slots, &cache[i].q_elem);
 	}
-	int *aux;
-	//thread_create("ahead_thread", PRI_DEFAULT, cache_read_ahead, aux);
+	thread_create("read_ahead", PRI_DEFAULT, cache_ahead_thread, NULL);
+	if(!cache_write_through && cache_flush_ticks > 0)
+		thread_create("write_behind", PRI_DEFAULT, cache_write_behind, NULL);
 
 }
 
-void 
+void
 cache_write(struct disk *d, disk_sector_t sec_no, const void *buffer)
 {
-	
+	struct buffer_cache *b;
+
+	lock_acquire(&cache_lock);
+	b = cache_fetch(d, sec_no, CACHE_WRITE | CACHE_NEW, true);
+	memcpy(b->buffer, buffer, DISK_SECTOR_SIZE);
+	b->dirty = true;
+	if(cache_write_through)
+		cache_flush(b, d);
+	lock_release(&cache_lock);
+
+}
+
+void
+cache_read(struct disk *d, disk_sector_t sec_no, void *buffer)
+{
+	struct buffer_cache *b;
+
+	lock_acquire(&cache_lock);
+	b = cache_fetch(d, sec_no, 0, true);
+	memcpy(buffer, b->buffer, DISK_SECTOR_SIZE);
+	lock_release(&cache_lock);
+}
+
+/* Copies SIZE bytes into BUFFER from the consecutive sectors
+   starting at SEC_NO, beginning OFS bytes into SEC_NO.  Cached
+   sectors are copied straight out; each stretch of the others
+   is read in with one disk read, rather than a sector at a
+   time.  The copying is done with the slots pinned and
+   cache_lock dropped, so that a fault on BUFFER cannot leave the
+   cache locked. */
+void
+cache_read_at(struct disk *d, disk_sector_t sec_no, void *buffer_, size_t ofs, size_t size)
+{
+	struct buffer_cache *slots[RUN_MAX];
+	uint8_t *buffer = buffer_;
+	size_t n, i, chunk;
+
+	ASSERT(ofs < DISK_SECTOR_SIZE);
+	lock_acquire(&cache_lock);
+	while(size > 0)
+	{
+		if(cache_lookup(sec_no) == NULL)
+		{
+			n = cache_load_run(d, sec_no, DIV_ROUND_UP(ofs + size, DISK_SECTOR_SIZE), slots);
+			cache_miss_cnt += n;
+		}
+		else
+		{
+			slots[0] = cache_fetch(d, sec_no, 0, true);
+			slots[0]->pin_cnt++;
+			n = 1;
+		}
+
+		lock_release(&cache_lock);
+		for(i=0; i<n; i++)
+		{
+			chunk = DISK_SECTOR_SIZE - ofs < size ? DISK_SECTOR_SIZE - ofs : size;
+			memcpy(buffer, slots[i]->buffer + ofs, chunk);
+			buffer += chunk;
+			size -= chunk;
+			ofs = 0;
+		}
+		lock_acquire(&cache_lock);
+		for(i=0; i<n; i++)
+			cache_unpin(slots[i]);
+		sec_no += n;
+	}
+	lock_release(&cache_lock);
+}
+
+/* Copies SIZE bytes from BUFFER into the consecutive sectors
+   starting at SEC_NO, beginning OFS bytes into SEC_NO.  Only a
+   partly overwritten sector that is not cached has to be read
+   first.  The sectors of a run stay pinned until all of them are
+   written, so that none is evicted in between; a run ends early
+   if the next sector would have to wait for a slot.  The slots
+   are pinned for writing while BUFFER is copied in with
+   cache_lock dropped, as cache_get() callers do, so that a fault
+   on BUFFER cannot leave the cache locked; a sector that is
+   overwritten whole is marked loading meanwhile, since it was
+   not read in.  In write-through mode, the sectors go to disk a
+   run at a time.  Only for file data: metadata is written with
+   cache_get(), so that the journal can hold it. */
+void
+cache_write_at(struct disk *d, disk_sector_t sec_no, const void *buffer_, size_t ofs, size_t size)
+{
+	struct buffer_cache *slots[RUN_MAX];
+	const uint8_t *buffer = buffer_;
+	size_t n, i, chunk, left;
+	enum cache_flags flags;
+
+	ASSERT(ofs < DISK_SECTOR_SIZE);
 	lock_acquire(&cache_lock);
-	disk_write(d, sec_no, buffer);
-	
-	int i;
-	for(i=0; i<BUFFER_SIZE; i++)
+	while(size > 0)
 	{
-		if(cache[i].used, cache[i].disk_sector == sec_no)
+		left = size;
+		for(n=0; n<run_limit(RUN_MAX) && left > 0; n++)
+		{
+			chunk = DISK_SECTOR_SIZE - (n == 0 ? ofs : 0);
+			if(chunk > left)
+				chunk = left;
+			flags = CACHE_WRITE;
+			if(chunk == DISK_SECTOR_SIZE)
+				flags |= CACHE_NEW;
+			slots[n] = cache_fetch(d, sec_no + n, flags, n == 0);
+			if(slots[n] == NULL)
+				break;
+			slots[n]->pin_cnt++;
+			slots[n]->write_cnt++;
+			if(flags & CACHE_NEW)
+				slots[n]->loading = true;
+			left -= chunk;
+		}
+
+		lock_release(&cache_lock);
+		for(i=0; i<n; i++)
+		{
+			chunk = DISK_SECTOR_SIZE - ofs < size ? DISK_SECTOR_SIZE - ofs : size;
+			memcpy(slots[i]->buffer + ofs, buffer, chunk);
+			buffer += chunk;
+			size -= chunk;
+			ofs = 0;
+		}
+		lock_acquire(&cache_lock);
+		for(i=0; i<n; i++)
 		{
-			memcpy(cache[i].buffer, buffer, DISK_SECTOR_SIZE);
-			cache[i].dirty = true;
-			cache[i].used = true;
-			cache[i].clock_bit = true;
-			goto done;
+			slots[i]->loading = false;
+			slots[i]->write_cnt--;
+			slots[i]->dirty = true;
+			cache_io_done(slots[i]);
+			cache_unpin(slots[i]);
 		}
+		if(cache_write_through)
+			for(i=0; i<n; )
+				i += cache_flush_run(slots + i, n - i, d);
+		sec_no += n;
 	}
+	lock_release(&cache_lock);
+}
+
+/* Pins sector SEC_NO in the cache and returns a pointer to its
+   DISK_SECTOR_SIZE bytes of data, which the caller may use in
+   place instead of copying them out.  The caller must pass
+   CACHE_WRITE if it will modify the data, and may add CACHE_NEW
+   if it will overwrite all of it and CACHE_META if the sector
+   holds file system metadata rather than file data.  The sector
+   stays resident until the caller hands it back with
+   cache_put().  With CACHE_HOLD, which the journal asks for,
+   it also stays resident, and is not written back, until the
+   journal passes it to cache_release(). */
+void *
+cache_get(struct disk *d, disk_sector_t sec_no, enum cache_flags flags)
+{
+	struct buffer_cache *b;
 
-	int evict_no = cache_evict(d);
-	disk_write(d, sec_no, buffer);
-	memcpy(cache[evict_no].buffer, buffer, DISK_SECTOR_SIZE);
-	cache[evict_no].disk_sector = sec_no;
-	cache[evict_no].used = true;
-	cache[evict_no].clock_bit = true;
-	
-done:
+	lock_acquire(&cache_lock);
+	b = cache_fetch(d, sec_no, flags, true);
+	b->pin_cnt++;
+	if(flags & CACHE_WRITE)
+		b->write_cnt++;
+	if(flags & CACHE_HOLD)
+		b->held = true;
 	lock_release(&cache_lock);
+	return b->buffer;
+}
+
+/* Unpins BUFFER, which was returned by cache_get().  DIRTY must
+   be true if the sector was got with CACHE_WRITE, in which case
+   it will be written back to disk. */
+void
+cache_put(void *buffer, bool dirty)
+{
+	struct buffer_cache *b;
+
+	b = &cache[((uint8_t *) buffer - cache_data) / DISK_SECTOR_SIZE];
+	ASSERT(b->buffer == buffer);
 
+	lock_acquire(&cache_lock);
+	ASSERT(b->pin_cnt > 0);
+	if(dirty)
+	{
+		ASSERT(b->write_cnt > 0);
+		b->write_cnt--;
+		b->dirty = true;
+	}
+	if(--b->pin_cnt == 0 || b->write_cnt == 0)
+		cache_io_done(b);
+	if(dirty && cache_write_through)
+		cache_flush(b, filesys_disk);
+	lock_release(&cache_lock);
 }
 
+/* Lets go of the CNT sectors in SECTORS, which the journal has
+   now logged, so that they can be written back and evicted like
+   any other. */
 void
-cache_read(struct disk *d, disk_sector_t sec_no, void *buffer)
+cache_release(const disk_sector_t *sectors, size_t cnt)
 {
-	
+	struct buffer_cache *b;
+	size_t i;
+
 	lock_acquire(&cache_lock);
-	int i;
-	struct ahead_entry *next_block=NULL;
-	next_block = palloc_get_page(0);
-	for(i=0; i<BUFFER_SIZE; i++)
+	for(i=0; i<cnt; i++)
 	{
-		if(cache[i].used && cache[i].disk_sector == sec_no)
+		b = cache_lookup(sectors[i]);
+		if(b != NULL && b->held)
 		{
-			memcpy(buffer, cache[i].buffer, DISK_SECTOR_SIZE);
-			cache[i].clock_bit = true;
-			goto done;
+			b->held = false;
+			cache_io_done(b);
 		}
-			
-	}
-	
-	int evict_no = cache_evict(d);
-	disk_read(d, sec_no, cache[evict_no].buffer);
-	memcpy(buffer, cache[evict_no].buffer, DISK_SECTOR_SIZE);
-	cache[evict_no].disk_sector = sec_no;
-	cache[evict_no].used = true;
-	cache[evict_no].clock_bit = true;
-	
-done:
-	next_block->disk_sector = sec_no;
-	//list_push_back(&ahead_list, &next_block->ahead_elem);
+	}
 	lock_release(&cache_lock);
 }
 
-void
-cache_close(void)
-{	
+/* Writes back whichever of the CNT sectors in SECTORS are cached
+   and dirty, in the order given, and waits for them to reach the
+   disk.  Sectors the journal holds are skipped; returns how many
+   of them were. */
+size_t
+cache_flush_sectors(struct disk *d, const disk_sector_t *sectors, size_t cnt)
+{
+	struct buffer_cache *b;
+	size_t i, held_cnt = 0;
+
 	lock_acquire(&cache_lock);
-	int i;
-	for(i=0; i<BUFFER_SIZE; i++)
+	for(i=0; i<cnt; i++)
 	{
-		if(cache[i].used)
-			cache_flush(filesys_disk,i);
+		b = cache_lookup(sectors[i]);
+		if(b != NULL)
+			cache_flush(b, d);
+		b = cache_lookup(sectors[i]);
+		if(b != NULL && b->held)
+			held_cnt++;
 	}
 	lock_release(&cache_lock);
-	//cache_ahead_close();
+	return held_cnt;
 }
 
-int
-cache_evict(struct disk *d)
+/* Returns the number of sectors the cache has room for, which
+   may be more than cache_sectors asked for. */
+size_t
+cache_size(void)
 {
-	int evict_no;
+	return cache_cnt;
+}
+
+void
+cache_close(void)
+{
+	cache_flush_dirty();
+}
+
+/* Prints buffer cache statistics.  Reads the counters without
+   cache_lock, since this also runs on the way down from a kernel
+   panic; a figure that is off by one then does no harm. */
+void
+cache_print_stats(void)
+{
+	long long total = cache_hit_cnt + cache_miss_cnt;
+
+	printf("Cache: %lld hits, %lld misses, %lld%% hit ratio (%s, %zu sectors)\n",
+	       cache_hit_cnt, cache_miss_cnt,
+	       total > 0 ? cache_hit_cnt * 100 / total : 0,
+	       cache_policy == CACHE_2Q ? "2q" : "clock", cache_cnt);
+	printf("Cache: %lld evictions, %lld write-backs, "
+	       "%lld read ahead, %lld of them used\n",
+	       cache_evict_cnt, cache_writeback_cnt,
+	       cache_ahead_cnt, cache_ahead_used_cnt);
+}
+
+/* Picks a slot to reuse and returns it clean and idle, with
+   cache_lock held.  Never-used slots go first; after that the
+   victim is chosen by cache_policy.  A dirty victim is written
+   back first, which drops cache_lock, so the choice is made
+   again afterward in case the victim was touched meanwhile.  If
+   every slot is busy, waits for one to become idle, or returns
+   a null pointer if WAIT is false. */
+struct buffer_cache *
+cache_evict(struct disk *d, bool wait)
+{
+	struct buffer_cache *b;
+
 	ASSERT(lock_held_by_current_thread(&cache_lock));
 	while(true)
 	{
-		if(!cache[clock].used)
-			return clock;
+		if(!list_empty(&free_slots))
+			return list_entry(list_front(&free_slots), struct buffer_cache, q_elem);
 
-		if(cache[clock].clock_bit)
-			cache[clock].clock_bit = false;
-		else
+		b = cache_policy == CACHE_2Q ? twoq_victim() : clock_victim();
+		if(b == NULL)
 		{
-			evict_no = clock;
-			break;
+			if(!wait)
+				return NULL;
+			cond_wait(&cond_idle, &cache_lock);
 		}
-
-		if(clock==BUFFER_SIZE-1)
-			clock = 0;
+		else if(b->dirty)
+			cache_flush(b, d);
 		else
-			clock++;
+			return b;
 	}
+}
 
-	if(cache[evict_no].dirty)
-		cache_flush(evict_no, d);
-
-	return evict_no;
+/* Writes slot B back to disk if it is dirty and the journal does
+   not hold it, once nobody has it pinned for writing.  Drops
+   cache_lock for the disk write; B is marked flushing meanwhile
+   so that it is neither evicted nor modified under the write. */
+void
+cache_flush(struct buffer_cache *b, struct disk *d)
+{
+	cache_flush_run(&b, 1, d);
+}
 
+/* Returns true if slot B has data to write back. */
+static bool
+cache_flushable(const struct buffer_cache *b)
+{
+	return b->used && b->dirty && !b->loading && !b->held;
 }
 
-void
-cache_flush(uint8_t evict_no, struct disk *d)
+/* Writes back SLOTS[0] as cache_flush() does, together with as
+   many of the slots after it in SLOTS, up to CNT in all, as
+   hold the sectors that follow its sector and can be written
+   back right away, all in one disk write.  Returns the number of
+   slots dealt with, at least 1. */
+static size_t
+cache_flush_run(struct buffer_cache **slots, size_t cnt, struct disk *d)
 {
+	const void *bufs[RUN_MAX];
+	struct buffer_cache *b = slots[0];
+	disk_sector_t sec_no;
+	size_t n, i;
+
 	ASSERT(lock_held_by_current_thread(&cache_lock));
-	if(cache[evict_no].dirty)
-		disk_write(d, cache[evict_no].disk_sector, cache[evict_no].buffer);
-	cache[evict_no].dirty = false;
-}
+	ASSERT(cnt > 0);
+	while(b->flushing || b->write_cnt > 0)
+		cond_wait(&b->io_done, &cache_lock);
+	if(!cache_flushable(b))
+		return 1;
+
+	/* Only the first slot is waited for, so that no slot is
+	   marked flushing while this thread waits. */
+	sec_no = b->disk_sector;
+	if(cnt > RUN_MAX)
+		cnt = RUN_MAX;
+	for(n=0; n<cnt; n++)
+	{
+		b = slots[n];
+		if(n > 0 && (b->flushing || b->write_cnt > 0 || !cache_flushable(b)
+		             || b->disk_sector != sec_no + n))
+			break;
+		b->flushing = true;
+		b->dirty = false;
+		bufs[n] = b->buffer;
+	}
 
+	cache_writeback_cnt += n;
+	lock_release(&cache_lock);
+	disk_write_multiple(d, sec_no, n, bufs);
+	lock_acquire(&cache_lock);
+	for(i=0; i<n; i++)
+	{
+		slots[i]->flushing = false;
+		cache_io_done(slots[i]);
+	}
+	return n;
+}
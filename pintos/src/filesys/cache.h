@@ -1,13 +1,44 @@
-#include "filesys/filesys.h"
-#include "filesys/filesys.h"
-#include "filesys/file.h"
-#include "filesys/inode.h"
-#include "threads/thread.h"
-#include "threads/synch.h"
-#include <debug.h>
-#include <list.h>
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/disk.h"
+
+/* How to get a sector with cache_get(). */
+enum cache_flags
+{
+	CACHE_WRITE = 001,              /* Caller will modify the sector. */
+	CACHE_NEW = 002,                /* Caller will overwrite all of it. */
+	CACHE_META = 004,               /* File system metadata: keep longer. */
+	CACHE_HOLD = 010                /* Journaled: keep until cache_release(). */
+};
+
+/* Buffer cache replacement policies. */
+enum cache_policy
+{
+	CACHE_CLOCK,                    /* Clock (second chance). */
+	CACHE_2Q                        /* Scan-resistant 2Q. */
+};
+
+extern bool cache_write_through;
+extern enum cache_policy cache_policy;
+extern int64_t cache_flush_ticks;
+extern size_t cache_sectors;
 
 void cache_init(void);
 void cache_close(void);
 void cache_write(struct disk *d, disk_sector_t sec_no, const void *buffer);
 void cache_read(struct disk *d, disk_sector_t sec_no, void *buffer);
+void cache_read_at(struct disk *d, disk_sector_t sec_no, void *buffer, size_t ofs, size_t size);
+void cache_write_at(struct disk *d, disk_sector_t sec_no, const void *buffer, size_t ofs, size_t size);
+void cache_read_ahead(struct disk *d, disk_sector_t sec_no, size_t cnt);
+void cache_print_stats(void);
+void *cache_get(struct disk *d, disk_sector_t sec_no, enum cache_flags flags);
+void cache_put(void *buffer, bool dirty);
+void cache_release(const disk_sector_t *sectors, size_t cnt);
+size_t cache_flush_sectors(struct disk *d, const disk_sector_t *sectors, size_t cnt);
+size_t cache_size(void);
+
+#endif /* filesys/cache.h */
@@ -1,10 +1,13 @@
 #include "filesys/directory.h"
+#include <hash.h>
+#include <list.h>
+#include <round.h>
 #include <stdio.h>
 #include <string.h>
-#include <list.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A directory. */
 struct dir 
@@ -13,20 +16,296 @@ struct dir
     off_t pos;                          /* Current position. */
   };
 
-/* A single directory entry. */
+/* A single directory entry.
+   Padded so that a whole number of entries fits in a sector and
+   no entry straddles two, which lets lookup() scan the cached
+   sectors in place. */
 struct dir_entry 
   {
     disk_sector_t inode_sector;         /* Sector number of header. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
     bool in_use;                        /* In use or free? */
+    uint8_t unused[12];                 /* Pad to 32 bytes. */
+  };
+
+/* A directory is an extendible hash table of its entries, so
+   that a lookup reads the header, at most one more sector of the
+   bucket table, and one bucket, however large the directory
+   grows.
+
+   The directory's first sector starts with a struct dir_header.
+   The bucket table follows it: 2**DEPTH bucket numbers, indexed
+   by the low DEPTH bits of the hash of a name.  Room is left for
+   the table to grow to 2**DIR_MAX_DEPTH entries; directories are
+   sparse files, so the unused room costs no disk space.  Buckets
+   follow, one sector each.
+
+   Each bucket has a local depth of its own.  A bucket whose local
+   depth is less than DEPTH is shared by several table entries.
+   When a bucket fills up it is split in two by one more bit of
+   the hash, doubling the table first if the bucket was not
+   shared.  Sectors never written, including the table entries
+   and buckets of a new directory, read as zeros, which is an
+   empty bucket 0 of depth 0. */
+struct dir_header
+  {
+    unsigned magic;                     /* DIR_MAGIC. */
+    uint32_t depth;                     /* Table has 2**DEPTH entries. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t entry_cnt;                 /* Entries in use. */
+    disk_sector_t parent;               /* Parent directory's inode. */
+    uint32_t unused[3];                 /* Not used. */
+  };
+
+/* A bucket of directory entries.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+#define BUCKET_ENTRIES (DISK_SECTOR_SIZE / sizeof (struct dir_entry) - 1)
+struct dir_bucket
+  {
+    uint32_t depth;                     /* Hash bits shared by entries. */
+    uint32_t cnt;                       /* Entries in use. */
+    uint8_t unused[24];                 /* Pad to one entry's size. */
+    struct dir_entry entries[BUCKET_ENTRIES];
   };
 
-/* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+/* Identifies a directory. */
+#define DIR_MAGIC 0x44495248
+
+/* Most hash bits the bucket table can use, which caps a directory
+   at 2**DIR_MAX_DEPTH buckets.  Kept small so that dir_add() fits
+   in one journal operation (see JOURNAL_OP_MAX) even when it
+   splits buckets: the header and the whole table take 5 sectors,
+   which every split touches, and each split adds one bucket. */
+#define DIR_MAX_DEPTH 9
+
+/* Byte offset of the bucket table, and sector of bucket 0. */
+#define TABLE_OFS ((off_t) sizeof (struct dir_header))
+#define BUCKET_BASE DIV_ROUND_UP (TABLE_OFS + (sizeof (uint32_t)      \
+                                               << DIR_MAX_DEPTH),     \
+                                  DISK_SECTOR_SIZE)
+
+/* Directory entry cache.  Remembers recent lookups, keyed by
+   the parent directory's inode sector and the name, so that
+   resolving the same paths again does not read directory data.
+   Failed lookups are remembered too, as entries whose
+   INODE_SECTOR is NO_INODE.  dir_add() and dir_remove() keep the
+   cache up to date.  At most DCACHE_SIZE entries are kept; the
+   least recently used one is replaced. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache while used. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+    disk_sector_t parent;               /* Directory, or NO_INODE if unused. */
+    char name[NAME_MAX + 1];            /* Name in PARENT. */
+    disk_sector_t inode_sector;         /* Inode, or NO_INODE if none. */
+  };
+
+#define DCACHE_SIZE 256
+#define NO_INODE ((disk_sector_t) -1)
+
+static struct dentry dentries[DCACHE_SIZE];
+static struct hash dcache;
+static struct list dcache_lru;          /* Front is most recently used. */
+static struct lock dcache_lock;
+
+/* Hash function for dcache. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Orders dcache entries by parent, then name. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the cache entry for NAME in directory PARENT, or a null
+   pointer if there is none. */
+static struct dentry *
+dcache_find (disk_sector_t parent, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&dcache_lock));
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Records that NAME in directory PARENT is the inode in
+   INODE_SECTOR, or that there is no such entry if INODE_SECTOR
+   is NO_INODE. */
+static void
+dcache_set (disk_sector_t parent, const char *name,
+            disk_sector_t inode_sector)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = dcache_find (parent, name);
+  if (d == NULL)
+    {
+      d = list_entry (list_back (&dcache_lru), struct dentry, lru_elem);
+      if (d->parent != NO_INODE)
+        hash_delete (&dcache, &d->hash_elem);
+      d->parent = parent;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache, &d->hash_elem);
+    }
+  d->inode_sector = inode_sector;
+  list_remove (&d->lru_elem);
+  list_push_front (&dcache_lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every entry for directory PARENT, which has been
+   removed, so that none of them applies to another directory
+   that reuses its sector. */
+static void
+dcache_purge (disk_sector_t parent)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    {
+      struct dentry *d = &dentries[i];
+      if (d->parent == parent)
+        {
+          hash_delete (&dcache, &d->hash_elem);
+          d->parent = NO_INODE;
+          list_remove (&d->lru_elem);
+          list_push_back (&dcache_lru, &d->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  size_t i;
+
+  if (!hash_init (&dcache, dentry_hash, dentry_less, NULL))
+    PANIC ("directory entry cache creation failed");
+  list_init (&dcache_lru);
+  lock_init (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    {
+      dentries[i].parent = NO_INODE;
+      list_push_back (&dcache_lru, &dentries[i].lru_elem);
+    }
+}
+
+/* Returns the byte offset of bucket BUCKET. */
+static off_t
+bucket_ofs (uint32_t bucket)
+{
+  return (BUCKET_BASE + bucket) * DISK_SECTOR_SIZE;
+}
+
+/* Returns the hash of NAME. */
+static uint32_t
+name_hash (const char *name)
+{
+  return hash_string (name);
+}
+
+/* Reads SIZE bytes at OFS in DIR into BUFFER.  Bytes past the end
+   of the directory read as zeros. */
+static void
+dir_read (const struct dir *dir, void *buffer, off_t size, off_t ofs)
+{
+  off_t n = inode_read_at (dir->inode, buffer, size, ofs);
+  if (n < size)
+    memset ((uint8_t *) buffer + n, 0, size - n);
+}
+
+/* Writes SIZE bytes from BUFFER at OFS in DIR.  Returns true if
+   successful, false if the disk is full. */
+static bool
+dir_write (struct dir *dir, const void *buffer, off_t size, off_t ofs)
+{
+  return inode_write_at (dir->inode, buffer, size, ofs) == size;
+}
+
+/* Returns the number of the bucket that table entry IDX of DIR
+   points to, reading it in place from the cached table. */
+static uint32_t
+table_get (const struct dir *dir, uint32_t idx)
+{
+  off_t ofs = TABLE_OFS + idx * sizeof (uint32_t);
+  const uint8_t *sector;
+  uint32_t bucket = 0;
+
+  sector = inode_pin_sector (dir->inode, ROUND_DOWN (ofs, DISK_SECTOR_SIZE));
+  if (sector != NULL)
+    {
+      bucket = *(const uint32_t *) (sector + ofs % DISK_SECTOR_SIZE);
+      inode_unpin_sector (sector);
+    }
+  return bucket;
+}
+
+/* Points table entry IDX of DIR at bucket BUCKET. */
+static bool
+table_set (struct dir *dir, uint32_t idx, uint32_t bucket)
+{
+  return dir_write (dir, &bucket, sizeof bucket,
+                    TABLE_OFS + idx * sizeof (uint32_t));
+}
+
+/* Returns the bucket of DIR, whose header is H, that NAME belongs
+   in, and stores its table index in *IDXP if IDXP is non-null. */
+static uint32_t
+find_bucket (const struct dir *dir, const struct dir_header *h,
+             const char *name, uint32_t *idxp)
+{
+  uint32_t idx = name_hash (name) & ((1u << h->depth) - 1);
+  if (idxp != NULL)
+    *idxp = idx;
+  return table_get (dir, idx);
+}
+
+/* Creates a directory in the given SECTOR whose parent is the
+   directory in sector PARENT.  Returns true if successful, false
+   on failure. */
 bool
-dir_create (disk_sector_t sector, size_t entry_cnt) 
+dir_create (disk_sector_t sector, disk_sector_t parent)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir_header h;
+  struct dir *dir;
+  bool success;
+
+  ASSERT (sizeof (struct dir_bucket) == DISK_SECTOR_SIZE);
+
+  if (!inode_create (sector, 0, true))
+    return false;
+  dir = dir_open (inode_open (sector));
+  if (dir == NULL)
+    return false;
+
+  /* The table entry and bucket that a new directory starts with
+     are all zeros, so only the header needs writing. */
+  memset (&h, 0, sizeof h);
+  h.magic = DIR_MAGIC;
+  h.bucket_cnt = 1;
+  h.parent = parent;
+  success = dir_write (dir, &h, sizeof h, 0);
+  dir_close (dir);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -35,7 +314,7 @@ struct dir *
 dir_open (struct inode *inode) 
 {
   struct dir *dir = calloc (1, sizeof *dir);
-  if (inode != NULL && dir != NULL)
+  if (inode != NULL && dir != NULL && inode_is_dir (inode))
     {
       dir->inode = inode;
       dir->pos = 0;
@@ -92,106 +371,269 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
-  
+  const struct dir_header *h;
+  const struct dir_bucket *b;
+  uint32_t bucket;
+  size_t i;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
+  h = inode_pin_sector (dir->inode, 0);
+  if (h == NULL)
+    return false;
+  bucket = find_bucket (dir, h, name, NULL);
+  inode_unpin_sector (h);
+
+  /* Compare names directly in the cached bucket rather than
+     copying it out. */
+  b = inode_pin_sector (dir->inode, bucket_ofs (bucket));
+  if (b == NULL)
+    return false;
+  for (i = 0; i < BUCKET_ENTRIES; i++)
+    {
+      const struct dir_entry *e = &b->entries[i];
+      if (e->in_use && !strcmp (name, e->name))
+        {
+          if (ep != NULL)
+            *ep = *e;
+          if (ofsp != NULL)
+            *ofsp = (const uint8_t *) e - (const uint8_t *) b
+                    + bucket_ofs (bucket);
+          inode_unpin_sector (b);
+          return true;
+        }
+    }
+  inode_unpin_sector (b);
   return false;
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   "." and ".." name DIR itself and its parent.
+   Answers from the directory entry cache if it can.  Other names
+   are looked up with DIR's inode locked, as dir_add() and
+   dir_remove() lock it, so that a miss cannot be cached over a
+   newer entry and a hit is opened before it can be removed. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
-            struct inode **inode) 
+            struct inode **inode)
 {
+  disk_sector_t parent;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  *inode = NULL;
+  if (inode_is_removed (dir->inode) || strlen (name) > NAME_MAX)
+    return false;
+  parent = inode_get_inumber (dir->inode);
+
+  if (!strcmp (name, "."))
+    *inode = inode_reopen (dir->inode);
+  else if (!strcmp (name, ".."))
+    {
+      struct dir_header h;
+      dir_read (dir, &h, sizeof h, 0);
+      *inode = inode_open (h.parent);
+    }
   else
-    *inode = NULL;
+    {
+      struct dentry *d;
+      disk_sector_t sector;
+
+      inode_lock (dir->inode);
+      lock_acquire (&dcache_lock);
+      d = dcache_find (parent, name);
+      sector = d != NULL ? d->inode_sector : NO_INODE;
+      lock_release (&dcache_lock);
+
+      if (d == NULL)
+        {
+          sector = lookup (dir, name, &e, NULL) ? e.inode_sector : NO_INODE;
+          dcache_set (parent, name, sector);
+        }
+      if (sector != NO_INODE)
+        *inode = inode_open (sector);
+      inode_unlock (dir->inode);
+    }
 
   return *inode != NULL;
 }
 
+/* Splits bucket BUCKET of DIR, whose header is H and whose
+   contents are in B, in two by one more bit of the hash, and
+   writes out both halves.  IDX is one of the table entries
+   pointing to BUCKET.  Doubles the table first if BUCKET is the
+   only bucket for its hash bits.
+   Returns false if the table cannot grow or a disk or memory
+   error occurs.  DIR's inode must be locked. */
+static bool
+split_bucket (struct dir *dir, struct dir_header *h, uint32_t bucket,
+              struct dir_bucket *b, uint32_t idx)
+{
+  struct dir_bucket *nb;
+  uint32_t new_bucket, bit, i;
+  bool success = false;
+
+  if (b->depth == h->depth)
+    {
+      /* Double the table: the new upper half points to the same
+         buckets as the lower half. */
+      off_t half = sizeof (uint32_t) << h->depth;
+      uint8_t chunk[64];
+      off_t ofs;
+
+      if (h->depth == DIR_MAX_DEPTH)
+        return false;
+      for (ofs = 0; ofs < half; ofs += sizeof chunk)
+        {
+          off_t n = half - ofs < (off_t) sizeof chunk ? half - ofs
+                                                      : (off_t) sizeof chunk;
+          dir_read (dir, chunk, n, TABLE_OFS + ofs);
+          if (!dir_write (dir, chunk, n, TABLE_OFS + half + ofs))
+            return false;
+        }
+      h->depth++;
+    }
+
+  nb = calloc (1, sizeof *nb);
+  if (nb == NULL)
+    return false;
+
+  /* Move the entries with the new bit set to the new bucket. */
+  bit = 1u << b->depth;
+  b->depth++;
+  nb->depth = b->depth;
+  new_bucket = h->bucket_cnt;
+  for (i = 0; i < BUCKET_ENTRIES; i++)
+    if (b->entries[i].in_use && (name_hash (b->entries[i].name) & bit))
+      {
+        nb->entries[nb->cnt++] = b->entries[i];
+        b->entries[i].in_use = false;
+        b->cnt--;
+      }
+  if (!dir_write (dir, nb, sizeof *nb, bucket_ofs (new_bucket))
+      || !dir_write (dir, b, sizeof *b, bucket_ofs (bucket)))
+    goto done;
+  h->bucket_cnt++;
+
+  /* Point the table entries that share the old bucket's low bits
+     and have the new bit set at the new bucket. */
+  for (i = (idx & (bit - 1)) | bit; i < 1u << h->depth; i += bit << 1)
+    if (!table_set (dir, i, new_bucket))
+      goto done;
+  success = dir_write (dir, h, sizeof *h, 0);
+
+ done:
+  free (nb);
+  return success;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
    Returns true if successful, false on failure.
-   Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   Fails if NAME is invalid (i.e. too long), DIR has been
+   removed, or a disk or memory error occurs.
+   DIR's inode stays locked from the check for NAME to the last
+   write, so that concurrent adds and removes do not interleave. */
 bool
 dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) 
 {
-  struct dir_entry e;
-  off_t ofs;
+  struct dir_header h;
+  struct dir_bucket *b;
   bool success = false;
-  
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
   /* Check NAME for validity. */
-  if (*name == '\0' || strlen (name) > NAME_MAX)
+  if (*name == '\0' || strlen (name) > NAME_MAX
+      || !strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
     return false;
+  inode_lock (dir->inode);
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  /* Check that DIR is still there and NAME is not in use. */
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  dir_read (dir, &h, sizeof h, 0);
+  for (;;)
+    {
+      uint32_t idx;
+      uint32_t bucket = find_bucket (dir, &h, name, &idx);
+      size_t i;
 
-  /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
-  e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+      dir_read (dir, b, sizeof *b, bucket_ofs (bucket));
+      if (b->cnt == BUCKET_ENTRIES)
+        {
+          /* Full.  Split it and try again. */
+          if (!split_bucket (dir, &h, bucket, b, idx))
+            break;
+          continue;
+        }
+
+      /* Write slot. */
+      for (i = 0; b->entries[i].in_use; i++)
+        continue;
+      b->entries[i].in_use = true;
+      strlcpy (b->entries[i].name, name, sizeof b->entries[i].name);
+      b->entries[i].inode_sector = inode_sector;
+      b->cnt++;
+      h.entry_cnt++;
+      success = (dir_write (dir, b, sizeof *b, bucket_ofs (bucket))
+                 && dir_write (dir, &h, sizeof h, 0));
+      break;
+    }
+  if (success)
+    dcache_set (inode_get_inumber (dir->inode), name, inode_sector);
 
  done:
+  inode_unlock (dir->inode);
+  free (b);
   return success;
 }
 
+/* Returns true if DIR has no entries besides "." and "..". */
+static bool
+dir_is_empty (struct dir *dir)
+{
+  struct dir_header h;
+  dir_read (dir, &h, sizeof h, 0);
+  return h.entry_cnt == 0;
+}
+
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs only if there is no file with the given NAME, or
+   if NAME is a directory that is not empty.
+   DIR's inode stays locked from the lookup of NAME to the last
+   write, and so does the inode of a directory being removed,
+   after DIR's, so that nothing is added to it meanwhile. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool locked = false;
   bool success = false;
-  off_t ofs;
+  uint32_t cnt;
+  off_t ofs, cnt_ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -201,31 +643,71 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  /* Erase directory entry. */
+  /* Only empty directories may be removed. */
+  if (inode_is_dir (inode))
+    {
+      struct dir *victim;
+      bool empty;
+
+      inode_lock (inode);
+      locked = true;
+      victim = dir_open (inode_reopen (inode));
+      empty = victim != NULL && dir_is_empty (victim);
+      dir_close (victim);
+      if (!empty)
+        goto done;
+    }
+
+  /* Erase directory entry, and count it out of its bucket and
+     the header. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  cnt_ofs = ROUND_DOWN (ofs, DISK_SECTOR_SIZE)
+            + offsetof (struct dir_bucket, cnt);
+  dir_read (dir, &cnt, sizeof cnt, cnt_ofs);
+  cnt--;
+  dir_read (dir, &h, sizeof h, 0);
+  h.entry_cnt--;
+  if (!dir_write (dir, &cnt, sizeof cnt, cnt_ofs)
+      || !dir_write (dir, &h, sizeof h, 0))
+    goto done;
 
   /* Remove inode. */
   inode_remove (inode);
+  dcache_set (inode_get_inumber (dir->inode), name, NO_INODE);
+  if (inode_is_dir (inode))
+    dcache_purge (inode_get_inumber (inode));
   success = true;
 
  done:
+  if (locked)
+    inode_unlock (inode);
+  inode_unlock (dir->inode);
   inode_close (inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  "." and ".." are not returned.
+   Entries come back in hash order; a bucket split while reading
+   may cause entries to be returned twice or not at all. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  struct dir_header h;
   struct dir_entry e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  dir_read (dir, &h, sizeof h, 0);
+  while ((uint32_t) dir->pos / BUCKET_ENTRIES < h.bucket_cnt)
     {
-      dir->pos += sizeof e;
+      uint32_t bucket = dir->pos / BUCKET_ENTRIES;
+      size_t i = dir->pos % BUCKET_ENTRIES;
+
+      dir_read (dir, &e, sizeof e, bucket_ofs (bucket)
+                + offsetof (struct dir_bucket, entries) + i * sizeof e);
+      dir->pos++;
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
@@ -234,3 +716,18 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
     }
   return false;
 }
+
+/* Sets DIR's position for dir_readdir() to POS, as returned by
+   dir_tell(). */
+void
+dir_seek (struct dir *dir, off_t pos)
+{
+  dir->pos = pos;
+}
+
+/* Returns DIR's position for dir_readdir(). */
+off_t
+dir_tell (struct dir *dir)
+{
+  return dir->pos;
+}
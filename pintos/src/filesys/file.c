@@ -113,6 +113,38 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Reads from FILE into the CNT pieces of memory described by
+   IOV, in order, starting at the file's current position.  The
+   pieces are read as one read of the underlying inode, so no
+   write to it lands between them.
+   Returns the number of bytes actually read, which may be less
+   than the total size of IOV if end of file is reached.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct file_iovec *iov, size_t cnt) 
+{
+  off_t bytes_read = inode_readv_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_read;
+  return bytes_read;
+}
+
+/* Writes the CNT pieces of memory described by IOV, in order,
+   into FILE, starting at the file's current position.  The
+   pieces are written as one write of the underlying inode, so
+   no other read or write of it sees some without the rest.
+   Returns the number of bytes actually written, which may be
+   less than the total size of IOV if the disk fills up or an
+   error occurs.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct file_const_iovec *iov,
+             size_t cnt) 
+{
+  off_t bytes_written = inode_writev_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
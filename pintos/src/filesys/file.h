@@ -1,10 +1,25 @@
 #ifndef FILESYS_FILE_H
 #define FILESYS_FILE_H
 
+#include <stddef.h>
 #include "filesys/off_t.h"
 
 struct inode;
 
+/* One piece of a vectored read: SIZE bytes at BASE. */
+struct file_iovec
+  {
+    void *base;                 /* Start of the piece. */
+    off_t size;                 /* Its size in bytes. */
+  };
+
+/* One piece of a vectored write: SIZE bytes at BASE. */
+struct file_const_iovec
+  {
+    const void *base;           /* Start of the piece. */
+    off_t size;                 /* Its size in bytes. */
+  };
+
 /* Opening and closing files. */
 struct file *file_open (struct inode *);
 struct file *file_reopen (struct file *);
@@ -16,6 +31,8 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+off_t file_readv (struct file *, const struct file_iovec *, size_t cnt);
+off_t file_writev (struct file *, const struct file_const_iovec *, size_t cnt);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
@@ -2,11 +2,14 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 #include "devices/disk.h"
+#include "threads/thread.h"
 
 /* The disk that contains the file system. */
 struct disk *filesys_disk;
@@ -22,8 +25,11 @@ filesys_init (bool format)
   if (filesys_disk == NULL)
     PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
+  cache_init ();
   inode_init ();
+  dir_init ();
   free_map_init ();
+  journal_init (format);
 
   if (format) 
     do_format ();
@@ -36,25 +42,156 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_done ();
   free_map_close ();
+  journal_close ();
+  cache_close ();
 }
 
+/* Extracts a file name part from *SRCP into PART, and updates
+   *SRCP so that the next call will return the next file name
+   part.  Returns 1 if successful, 0 at end of string, -1 for a
+   too-long file name part. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX character from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
+/* Returns the sector of DIR's inode. */
+static disk_sector_t
+dir_sector (struct dir *dir) 
+{
+  return inode_get_inumber (dir_get_inode (dir));
+}
+
+/* Opens the directory that holds the last component of PATH and
+   copies that component into NAME.  Relative paths start at the
+   running thread's working directory.  If PATH names the root
+   directory, NAME is set to ".".
+   Returns a null pointer if PATH is empty, has a component that
+   is too long, or passes through something that is not a
+   directory. */
+static struct dir *
+open_parent (const char *path, char name[NAME_MAX + 1])
+{
+  struct thread *t = thread_current ();
+  char part[NAME_MAX + 1];
+  struct dir *dir;
+  int ok;
+
+  if (*path == '\0')
+    return NULL;
+  if (*path == '/' || t->cwd == NULL)
+    dir = dir_open_root ();
+  else
+    dir = dir_reopen (t->cwd);
+
+  strlcpy (name, ".", NAME_MAX + 1);
+  while (dir != NULL && (ok = get_next_part (part, &path)) != 0)
+    {
+      struct inode *inode;
+      const char *rest = path;
+
+      if (ok < 0)
+        break;
+
+      /* The last component is the caller's. */
+      if (get_next_part (name, &rest) == 0)
+        {
+          strlcpy (name, part, NAME_MAX + 1);
+          return dir;
+        }
+
+      dir_lookup (dir, part, &inode);
+      dir_close (dir);
+      dir = dir_open (inode);
+    }
+  if (dir != NULL && ok < 0)
+    {
+      dir_close (dir);
+      dir = NULL;
+    }
+  return dir;
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
-   or if internal memory allocation fails. */
+   or if internal memory allocation fails.
+   The free map, inode and directory updates are one journal
+   operation, so that a crash keeps all of them or none. */
 bool
 filesys_create (const char *name, off_t initial_size) 
 {
   disk_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
+  char part[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = open_parent (name, part);
+  success = (dir != NULL
+             && free_map_allocate_near (1, free_map_inode_hint
+                                          (dir_sector (dir), false),
+                                        &inode_sector)
+             && inode_create (inode_sector, initial_size, false)
+             && dir_add (dir, part, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Creates a directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails. */
+bool
+filesys_mkdir (const char *name) 
+{
+  disk_sector_t inode_sector = 0;
+  char part[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = open_parent (name, part);
+  success = (dir != NULL
+             && free_map_allocate_near (1, free_map_inode_hint
+                                          (dir_sector (dir), true),
+                                        &inode_sector)
+             && dir_create (inode_sector, dir_sector (dir))
+             && dir_add (dir, part, inode_sector));
+  if (!success && inode_sector != 0) 
+    free_map_release (inode_sector, 1);
+  dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -67,11 +204,12 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  char part[NAME_MAX + 1];
+  struct dir *dir = open_parent (name, part);
   struct inode *inode = NULL;
 
   if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+    dir_lookup (dir, part, &inode);
   dir_close (dir);
 
   return file_open (inode);
@@ -79,26 +217,56 @@ filesys_open (const char *name)
 
 /* Deletes the file named NAME.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if no file named NAME exists, if NAME is a directory
+   that is not empty, or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char part[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = open_parent (name, part);
+  success = dir != NULL && dir_remove (dir, part);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
-
+
+/* Makes directory NAME the running thread's working directory.
+   Returns true if successful, false on failure. */
+bool
+filesys_chdir (const char *name) 
+{
+  struct thread *t = thread_current ();
+  char part[NAME_MAX + 1];
+  struct dir *dir = open_parent (name, part);
+  struct inode *inode = NULL;
+
+  if (dir != NULL)
+    dir_lookup (dir, part, &inode);
+  dir_close (dir);
+
+  dir = dir_open (inode);
+  if (dir == NULL)
+    return false;
+  dir_close (t->cwd);
+  t->cwd = dir;
+  return true;
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_begin ();
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
+  journal_end ();
   free_map_close ();
   printf ("done.\n");
 }
@@ -1,51 +1,416 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* free_map_lock protects the free map and everything derived
+   from it below.  It is taken inside a journal operation, after
+   any inode lock, and free_map_sync() holds it while it takes the
+   free map file's own. */
+static struct lock free_map_lock;
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
+static size_t free_cnt;              /* Free sectors not reserved. */
+
+/* Changes to the free map are not written to the free map file
+   as they happen.  Instead, each sector of the file whose part of
+   the free map changed is marked here, and free_map_sync() writes
+   only those sectors, all at once. */
+static struct bitmap *dirty_map;     /* One bit per free map file sector. */
+
+#define BITS_PER_SECTOR (DISK_SECTOR_SIZE * 8)
+
+/* Allocation groups.  The disk is divided into groups of
+   GROUP_SECTORS sectors, the last possibly shorter.  A new file's
+   inode goes in the group of its directory and a new directory's
+   inode in the group with the most free sectors, so that each
+   directory's files sit together and unrelated directories do not
+   interleave.  Inodes are taken from the front of a group and
+   data from after its first GROUP_INODE_SECTORS sectors, which
+   keeps the inodes of a directory's files close to each other
+   and to the directory. */
+#define GROUP_SECTORS 1024           /* Sectors per group. */
+#define GROUP_INODE_SECTORS 32       /* Sectors at front meant for inodes. */
+
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t group_cnt;             /* Number of groups. */
+
+/* Free-run tree: a complete binary tree over the free map, stored
+   as an array with the root at index 1 and the children of node
+   I at 2 * I and 2 * I + 1.  Each leaf covers RUN_CHUNK sectors;
+   sectors past the end of the disk count as in use.  Each node
+   records the free runs at either end of its range and the
+   longest free run within it, which lets free_map_allocate()
+   skip any subtree too fragmented to hold the run it wants and
+   so find one in logarithmic time. */
+struct run_node
+  {
+    uint32_t head;                   /* Free sectors at start of range. */
+    uint32_t tail;                   /* Free sectors at end of range. */
+    uint32_t best;                   /* Longest free run in range. */
+  };
+
+#define RUN_CHUNK 32                 /* Sectors per leaf. */
+
+static struct run_node *run_tree;    /* 2 * LEAF_CNT nodes. */
+static size_t leaf_cnt;              /* Leaves, a power of 2. */
+
+/* Recomputes leaf LEAF of the free-run tree from the free map. */
+static void
+run_leaf (size_t leaf) 
+{
+  struct run_node *r = &run_tree[leaf_cnt + leaf];
+  size_t first = leaf * RUN_CHUNK;
+  size_t size = bitmap_size (free_map);
+  size_t i, run = 0;
+
+  r->head = r->best = 0;
+  for (i = 0; i < RUN_CHUNK; i++) 
+    {
+      if (first + i < size && !bitmap_test (free_map, first + i))
+        {
+          run++;
+          if (run > r->best)
+            r->best = run;
+          if (run == i + 1)
+            r->head = run;
+        }
+      else
+        run = 0;
+    }
+  r->tail = run;
+}
+
+/* Recomputes interior node NODE of the free-run tree, which
+   covers LEN sectors, from its children. */
+static void
+run_combine (size_t node, size_t len) 
+{
+  const struct run_node *l = &run_tree[2 * node];
+  const struct run_node *r = &run_tree[2 * node + 1];
+  struct run_node *n = &run_tree[node];
+  size_t half = len / 2;
+
+  n->head = l->head == half ? half + r->head : l->head;
+  n->tail = r->tail == half ? half + l->tail : r->tail;
+  n->best = l->tail + r->head;
+  if (l->best > n->best)
+    n->best = l->best;
+  if (r->best > n->best)
+    n->best = r->best;
+}
+
+/* Brings the free-run tree up to date after the free map changed
+   for CNT sectors starting at SECTOR. */
+static void
+run_update (size_t sector, size_t cnt) 
+{
+  size_t first = sector / RUN_CHUNK;
+  size_t last = (sector + cnt - 1) / RUN_CHUNK;
+  size_t leaf, node, len;
+
+  for (leaf = first; leaf <= last; leaf++)
+    run_leaf (leaf);
+  for (first += leaf_cnt, last += leaf_cnt, len = 2 * RUN_CHUNK;
+       first > 1; first /= 2, last /= 2, len *= 2)
+    for (node = first / 2; node <= last / 2; node++)
+      run_combine (node, len);
+}
+
+/* Rebuilds the whole free-run tree from the free map. */
+static void
+run_build (void) 
+{
+  size_t leaves = DIV_ROUND_UP (bitmap_size (free_map), RUN_CHUNK);
+
+  for (leaf_cnt = 1; leaf_cnt < leaves; leaf_cnt *= 2)
+    continue;
+  free (run_tree);
+  run_tree = malloc (2 * leaf_cnt * sizeof *run_tree);
+  if (run_tree == NULL)
+    PANIC ("free-run tree creation failed--disk is too large");
+  run_update (0, leaf_cnt * RUN_CHUNK);
+}
+
+/* Searches subtree NODE, which covers the LEN sectors starting at
+   START, for the first run of CNT free sectors that starts at or
+   after sector FROM.  *CARRY is the number of free sectors, all
+   at or after FROM, that directly precede START; on return it is
+   the number that directly follow the subtree's last sector.
+   Returns the first sector of the run, or BITMAP_ERROR if there
+   is none. */
+static size_t
+run_search (size_t node, size_t start, size_t len, size_t from,
+            size_t cnt, size_t *carry) 
+{
+  const struct run_node *r = &run_tree[node];
+  size_t sector;
+
+  if (start + len <= from)
+    {
+      *carry = 0;
+      return BITMAP_ERROR;
+    }
+  if (start >= from)
+    {
+      /* Answer from the summary if possible. */
+      if (*carry + r->head >= cnt)
+        return start - *carry;
+      if (r->best < cnt)
+        {
+          *carry = r->head == len ? *carry + len : r->tail;
+          return BITMAP_ERROR;
+        }
+    }
+
+  if (node >= leaf_cnt)
+    {
+      /* Scan the leaf's sectors. */
+      size_t size = bitmap_size (free_map);
+      for (sector = start > from ? start : from; sector < start + len;
+           sector++)
+        if (sector < size && !bitmap_test (free_map, sector))
+          {
+            if (++*carry >= cnt)
+              return sector + 1 - cnt;
+          }
+        else
+          *carry = 0;
+      return BITMAP_ERROR;
+    }
+
+  sector = run_search (2 * node, start, len / 2, from, cnt, carry);
+  if (sector == BITMAP_ERROR)
+    sector = run_search (2 * node + 1, start + len / 2, len / 2, from,
+                         cnt, carry);
+  return sector;
+}
+
+/* Marks the free map file sectors that hold the bits for CNT
+   sectors starting at SECTOR as needing to be written. */
+static void
+mark_dirty (size_t sector, size_t cnt) 
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Recounts the free sectors in each group from the free map. */
+static void
+group_build (void) 
+{
+  size_t size = bitmap_size (free_map);
+  size_t g;
+
+  group_cnt = DIV_ROUND_UP (size, GROUP_SECTORS);
+  free (group_free);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("allocation group creation failed--disk is too large");
+  for (g = 0; g < group_cnt; g++) 
+    {
+      size_t first = g * GROUP_SECTORS;
+      size_t cnt = size - first < GROUP_SECTORS ? size - first : GROUP_SECTORS;
+      group_free[g] = bitmap_count (free_map, first, cnt, false);
+    }
+}
+
+/* Adjusts the group free counts for CNT sectors starting at
+   SECTOR, which just became used if USED is true or free
+   otherwise. */
+static void
+group_update (size_t sector, size_t cnt, bool used) 
+{
+  while (cnt > 0) 
+    {
+      size_t g = sector / GROUP_SECTORS;
+      size_t n = (g + 1) * GROUP_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+      if (used)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
+  lock_init (&free_map_lock);
   free_map = bitmap_create (disk_size (filesys_disk));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--disk is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                           DISK_SECTOR_SIZE));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--disk is too large");
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  run_build ();
+  group_build ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if all sectors were
+   available.  Sectors set aside by free_map_reserve() are not
    available. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) 
 {
-  disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but takes the first run of CNT free
+   sectors at or after HINT, and only if there is none, the first
+   before it.  Callers pass a sector near data that will be used
+   along with the new sectors, such as the end of a file's last
+   extent, to keep related data close together on disk. */
+bool
+free_map_allocate_near (size_t cnt, disk_sector_t hint,
+                        disk_sector_t *sectorp) 
+{
+  size_t sector, carry = 0;
+
+  if (cnt == 0)
+    return false;
+  lock_acquire (&free_map_lock);
+  if (cnt > free_cnt)
+    {
+      lock_release (&free_map_lock);
+      return false;
+    }
+  if (hint >= bitmap_size (free_map))
+    hint = 0;
+  sector = run_search (1, 0, leaf_cnt * RUN_CHUNK, hint, cnt, &carry);
+  if (sector == BITMAP_ERROR && hint > 0)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      carry = 0;
+      sector = run_search (1, 0, leaf_cnt * RUN_CHUNK, 0, cnt, &carry);
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  if (sector == BITMAP_ERROR)
+    {
+      lock_release (&free_map_lock);
+      return false;
+    }
+
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  mark_dirty (sector, cnt);
+  run_update (sector, cnt);
+  group_update (sector, cnt, true);
+  free_cnt -= cnt;
+  lock_release (&free_map_lock);
+  *sectorp = sector;
+  return true;
+}
+
+/* Returns the sector at which to look for a sector for a new
+   inode, to be passed to free_map_allocate_near().  PARENT is the
+   inode sector of the directory that will contain it.  A file is
+   placed in its directory's group, unless that group is full; a
+   directory, in the group with the most free sectors. */
+disk_sector_t
+free_map_inode_hint (disk_sector_t parent, bool is_dir) 
+{
+  size_t best = parent / GROUP_SECTORS;
+  size_t g;
+
+  lock_acquire (&free_map_lock);
+  if (is_dir || group_free[best] == 0)
+    for (g = 0; g < group_cnt; g++)
+      if (group_free[g] > group_free[best])
+        best = g;
+  lock_release (&free_map_lock);
+  return best * GROUP_SECTORS;
+}
+
+/* Returns the sector at which to look for sectors for the first
+   data of the file whose inode is at INODE_SECTOR, to be passed
+   to free_map_allocate_near(): the start of the data area of the
+   inode's group. */
+disk_sector_t
+free_map_data_hint (disk_sector_t inode_sector) 
+{
+  return inode_sector / GROUP_SECTORS * GROUP_SECTORS + GROUP_INODE_SECTORS;
+}
+
+/* Sets aside CNT sectors, without choosing which, for a later
+   free_map_unreserve() and free_map_allocate().  Returns true if
+   successful, false if fewer than CNT sectors are available. */
+bool
+free_map_reserve (size_t cnt) 
+{
+  bool success = false;
+
+  lock_acquire (&free_map_lock);
+  if (cnt <= free_cnt)
+    {
+      free_cnt -= cnt;
+      success = true;
+    }
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Returns CNT sectors set aside by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt) 
+{
+  lock_acquire (&free_map_lock);
+  free_cnt += cnt;
+  lock_release (&free_map_lock);
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  run_update (sector, cnt);
+  group_update (sector, cnt, false);
+  mark_dirty (sector, cnt);
+  free_cnt += cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file whose part of the free
+   map has changed since they were last written.  The writes go
+   through the buffer cache like any other file data.  Only a
+   journal commit calls this, so that the free map is never
+   being written when a full transaction has to commit. */
+void
+free_map_sync (void) 
+{
+  size_t idx;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (idx = 0; idx < bitmap_size (dirty_map); idx++)
+      if (bitmap_test (dirty_map, idx)) 
+        {
+          if (!bitmap_write_part (free_map, free_map_file,
+                                  idx * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE))
+            PANIC ("can't write free map");
+          bitmap_reset (dirty_map, idx);
+        }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -57,13 +422,21 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (dirty_map, false);
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  run_build ();
+  group_build ();
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the free map to disk, by committing the journal, and
+   closes the free map file.  Must not be called within a journal
+   operation. */
 void
 free_map_close (void) 
 {
+  journal_commit ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -71,14 +444,24 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
-  /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  struct inode *inode;
+  struct file *file;
+
+  /* Create inode.  Allocate all of its blocks now: writing a
+     sparse free map file would need the free map written first. */
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
+    PANIC ("free map creation failed");
+  inode = inode_open (FREE_MAP_SECTOR);
+  if (inode == NULL || !inode_reserve (inode, bitmap_file_size (free_map)))
     PANIC ("free map creation failed");
 	
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  Until it is written, a commit must
+     not try to sync it. */
+  file = file_open (inode);
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  if (!bitmap_write (free_map, file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
+  free_map_file = file;
 }
@@ -10,8 +10,14 @@ void free_map_read (void);
 void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
+void free_map_sync (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
+bool free_map_allocate_near (size_t, disk_sector_t hint, disk_sector_t *);
 void free_map_release (disk_sector_t, size_t);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
+disk_sector_t free_map_inode_hint (disk_sector_t parent, bool is_dir);
+disk_sector_t free_map_data_hint (disk_sector_t inode_sector);
 
 #endif /* filesys/free-map.h */
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
@@ -195,3 +196,10 @@ fsutil_get (char **argv)
   file_close (src);
   free (buffer);
 }
+
+/* Prints buffer cache statistics so far. */
+void
+fsutil_cache_stats (char **argv UNUSED)
+{
+  cache_print_stats ();
+}
@@ -1,26 +1,76 @@
 #include "filesys/inode.h"
-#include <list.h>
 #include <debug.h>
+#include <hash.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Extents listed directly in the inode. */
+#define INLINE_EXTENTS 41
+
+/* Extents listed in each block of the extent chain. */
+#define BLOCK_EXTENTS 42
+
+/* Most appended blocks held back from allocation per inode. */
+#define DELAY_MAX 32
+
+/* Most sectors inode_read_at() asks to have read ahead. */
+#define READ_AHEAD_MAX 16
 
-#define DIRECT 125
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Inode flags. */
+#define INODE_DIR 0x1                   /* Directory. */
+#define INODE_INLINE 0x2                /* Data kept in the inode. */
+
+/* Largest file whose data fits in its inode. */
+#define INLINE_SIZE (INLINE_EXTENTS * (off_t) sizeof (struct extent))
+
+/* A run of LENGTH file blocks starting at file block BLOCK,
+   stored in LENGTH consecutive disk sectors starting at START. */
+struct extent
+  {
+    uint32_t block;                     /* First file block. */
+    disk_sector_t start;                /* First disk sector. */
+    uint32_t length;                    /* Number of blocks. */
+  };
+
 /* On-disk inode.
-   Must be exactly DISK_SECTOR_SIZE bytes long. */
+   Must be exactly DISK_SECTOR_SIZE bytes long.
+   The first INLINE_EXTENTS extents, in file block order, are
+   kept here.  The rest continue in a chain of extent blocks
+   starting at EXT_NEXT.  A small regular file is instead marked
+   INODE_INLINE and keeps its data where the extents would go,
+   until it grows past INLINE_SIZE bytes; it has no blocks, so it
+   costs one sector and one read. */
 struct inode_disk
   {
-    disk_sector_t direct[DIRECT];
-		disk_sector_t ddirect;
-		//disk_sector_t start;                /* First data sector. */
+    union
+      {
+        struct extent extents[INLINE_EXTENTS]; /* First extents. */
+        uint8_t inline_data[INLINE_SIZE];      /* Or the data itself. */
+      };
+    disk_sector_t ext_next;             /* First extent block, or 0. */
+    uint32_t extent_cnt;                /* Number of extents in all. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    //uint32_t unused[125];               /* Not used. */
+    uint32_t flags;                     /* INODE_* flags. */
+  };
+
+/* On-disk extent block.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_block
+  {
+    struct extent extents[BLOCK_EXTENTS]; /* Next extents. */
+    disk_sector_t next;                 /* Next extent block, or 0. */
+    uint32_t unused[1];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -31,49 +81,625 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, DISK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   RW protects the inode's data and extents, the members from
+   EXTENTS on.  Readers hold it shared, so reads of one file from
+   several processes proceed in parallel.  Writes that only
+   overwrite sectors the file already has also hold it shared;
+   writes that extend the file, fill holes, touch the delayed
+   allocation buffer or change metadata hold it exclusively.
+   The read-ahead state is updated by readers without exclusion;
+   it only steers prefetching.  RW is taken after
+   journal_begin(), like any file system lock, and dropped
+   before journal_end().
+
+   LOCK, taken with inode_lock(), is for callers that make one
+   change out of several reads and writes, such as adding a
+   directory entry.  It is taken before RW. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     disk_sector_t sector;               /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* Being read in by inode_open(). */
+    bool closing;                       /* Being let go by inode_close(). */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    off_t read_end;                     /* Offset just past the last read. */
+    int stream_cnt;                     /* Sequential reads in a row. */
+    off_t ahead_end;                    /* Read ahead up to this offset. */
+    struct extent *extents;             /* All extents, in block order. */
+    size_t extent_cap;                  /* Room in EXTENTS. */
+    size_t extent_hint;                 /* Extent found by last lookup. */
+    disk_sector_t *chain;               /* Extent block sectors, in order. */
+    size_t chain_cnt;                   /* Number of extent blocks. */
+    uint32_t delay_block;               /* First block held in DELAY_BUF. */
+    size_t delay_cnt;                   /* Blocks held in DELAY_BUF. */
+    uint8_t *delay_buf;                 /* Written but unallocated blocks. */
     struct inode_disk data;             /* Inode content. */
+    struct rwlock rw;                   /* Readers-writer lock, see above. */
+    struct lock lock;                   /* See inode_lock(). */
   };
 
+/* Copies metadata sector SECTOR into BUFFER through the buffer
+   cache. */
+static void
+read_meta (disk_sector_t sector, void *buffer) 
+{
+  const void *data = cache_get (filesys_disk, sector, CACHE_META);
+  memcpy (buffer, data, DISK_SECTOR_SIZE);
+  cache_put ((void *) data, false);
+}
+
+/* Returns true if INODE's data is file system metadata, which
+   is journaled and never held back for delayed allocation: a
+   directory or the free map. */
+static bool
+is_meta (const struct inode *inode) 
+{
+  return (inode->data.flags & INODE_DIR) || inode->sector == FREE_MAP_SECTOR;
+}
+
+/* Returns FLAGS plus the cache flags for writing metadata sector
+   SECTOR, which joins the running journal transaction.  The
+   sector must be put back with meta_put(). */
+static enum cache_flags
+meta_flags (disk_sector_t sector, enum cache_flags flags) 
+{
+  journal_dirty (sector);
+  return flags | CACHE_WRITE | CACHE_META | CACHE_HOLD;
+}
+
+/* Puts back DATA, a metadata sector got with meta_flags(). */
+static void
+meta_put (void *data) 
+{
+  cache_put (data, true);
+  journal_written ();
+}
+
+/* Writes BUFFER to metadata sector SECTOR through the buffer
+   cache. */
+static void
+write_meta (disk_sector_t sector, const void *buffer) 
+{
+  void *data = cache_get (filesys_disk, sector,
+                          meta_flags (sector, CACHE_NEW));
+  memcpy (data, buffer, DISK_SECTOR_SIZE);
+  meta_put (data);
+}
+
+/* Returns the index of the extent of INODE that contains file
+   block BLOCK or, if none does, of the first extent past it.
+   The extent found last time is tried first, since most access
+   is sequential. */
+static size_t
+extent_find (struct inode *inode, uint32_t block) 
+{
+  const struct extent *e;
+  size_t lo, hi;
+
+  if (inode->extent_hint < inode->data.extent_cnt) 
+    {
+      e = &inode->extents[inode->extent_hint];
+      if (block >= e->block && block - e->block < e->length)
+        return inode->extent_hint;
+    }
+
+  lo = 0;
+  hi = inode->data.extent_cnt;
+  while (lo < hi) 
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      e = &inode->extents[mid];
+      if (e->block + e->length <= block)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  inode->extent_hint = lo;
+  return lo;
+}
+
+/* Returns the disk sector that contains byte offset POS within
+   INODE, and stores in *CNT the number of sectors, that one
+   included, that follow it on disk within the same extent.
+   Returns -1, with *CNT set to 1, if INODE does not contain data
+   for a byte at offset POS. */
+static disk_sector_t
+byte_to_run (struct inode *inode, off_t pos, size_t *cnt) 
+{
+  uint32_t block;
+  const struct extent *e;
+  size_t idx;
+
+  ASSERT (inode != NULL);
+  *cnt = 1;
+  if (pos >= inode->data.length)
+    return -1;
+
+  block = pos / DISK_SECTOR_SIZE;
+  idx = extent_find (inode, block);
+  if (idx >= inode->data.extent_cnt)
+    return -1;
+  e = &inode->extents[idx];
+  if (block < e->block)
+    return -1;
+  *cnt = e->length - (block - e->block);
+  return e->start + (block - e->block);
+}
+
 /* Returns the disk sector that contains byte offset POS within
    INODE.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
-  ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / DISK_SECTOR_SIZE;
-  else
-    return -1;
+  size_t cnt;
+
+  return byte_to_run (inode, pos, &cnt);
+}
+
+/* Makes sure INODE can take one more extent, growing its extent
+   array and allocating another extent block if needed, so that
+   extent_add() cannot fail.
+   Returns false if memory or disk allocation fails. */
+static bool
+extent_reserve (struct inode *inode) 
+{
+  size_t cnt = inode->data.extent_cnt + 1;
+
+  if (cnt > inode->extent_cap) 
+    {
+      size_t cap = inode->extent_cap * 2;
+      struct extent *extents = realloc (inode->extents,
+                                        cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extent_cap = cap;
+    }
+
+  if (cnt > INLINE_EXTENTS + inode->chain_cnt * BLOCK_EXTENTS) 
+    {
+      disk_sector_t *chain = realloc (inode->chain,
+                                      (inode->chain_cnt + 1) * sizeof *chain);
+      if (chain == NULL)
+        return false;
+      inode->chain = chain;
+      if (!free_map_allocate_near (1, inode->sector,
+                                   &chain[inode->chain_cnt]))
+        return false;
+      inode->chain_cnt++;
+    }
+  return true;
+}
+
+/* Maps file blocks BLOCK through BLOCK + LENGTH - 1 of INODE,
+   which must not be mapped yet, to LENGTH sectors starting at
+   START.  The run is merged into a neighboring extent if it
+   continues it both in the file and on disk.  The caller must
+   have called extent_reserve() first. */
+static void
+extent_add (struct inode *inode, uint32_t block, disk_sector_t start,
+            uint32_t length) 
+{
+  size_t idx = extent_find (inode, block);
+  size_t cnt = inode->data.extent_cnt;
+  struct extent *e = inode->extents;
+
+  ASSERT (idx == cnt || e[idx].block >= block + length);
+
+  if (idx > 0 && e[idx - 1].block + e[idx - 1].length == block
+      && e[idx - 1].start + e[idx - 1].length == start) 
+    {
+      /* Continues the previous extent. */
+      e[idx - 1].length += length;
+      if (idx < cnt && e[idx].block == block + length
+          && e[idx].start == start + length) 
+        {
+          /* ...and closes the gap to the next one. */
+          e[idx - 1].length += e[idx].length;
+          memmove (&e[idx], &e[idx + 1], (cnt - idx - 1) * sizeof *e);
+          inode->data.extent_cnt--;
+        }
+    }
+  else if (idx < cnt && e[idx].block == block + length
+           && e[idx].start == start + length) 
+    {
+      /* Runs right into the next extent. */
+      e[idx].block = block;
+      e[idx].start = start;
+      e[idx].length += length;
+    }
+  else 
+    {
+      ASSERT (cnt < inode->extent_cap);
+      memmove (&e[idx + 1], &e[idx], (cnt - idx) * sizeof *e);
+      e[idx].block = block;
+      e[idx].start = start;
+      e[idx].length = length;
+      inode->data.extent_cnt++;
+    }
+}
+
+/* Writes INODE's length and extent table, or its inline data,
+   back to its inode sector and extent blocks. */
+static void
+extents_store (struct inode *inode) 
+{
+  size_t cnt = inode->data.extent_cnt;
+  size_t i, done;
+
+  if (inode->data.flags & INODE_INLINE) 
+    {
+      write_meta (inode->sector, &inode->data);
+      return;
+    }
+
+  done = cnt < INLINE_EXTENTS ? cnt : INLINE_EXTENTS;
+  memset (inode->data.extents, 0, sizeof inode->data.extents);
+  memcpy (inode->data.extents, inode->extents,
+          done * sizeof *inode->extents);
+  inode->data.ext_next = inode->chain_cnt > 0 ? inode->chain[0] : 0;
+  write_meta (inode->sector, &inode->data);
+
+  for (i = 0; i < inode->chain_cnt; i++) 
+    {
+      struct extent_block *eb;
+      size_t n = cnt - done < BLOCK_EXTENTS ? cnt - done : BLOCK_EXTENTS;
+
+      eb = cache_get (filesys_disk, inode->chain[i],
+                      meta_flags (inode->chain[i], CACHE_NEW));
+      memset (eb, 0, sizeof *eb);
+      memcpy (eb->extents, inode->extents + done, n * sizeof *eb->extents);
+      eb->next = i + 1 < inode->chain_cnt ? inode->chain[i + 1] : 0;
+      meta_put (eb);
+      done += n;
+    }
+}
+
+/* Reads INODE's extent table, whose inline part is already in
+   INODE->data, in from its extent blocks.
+   Returns false if memory allocation fails. */
+static bool
+extents_load (struct inode *inode) 
+{
+  size_t cnt = inode->data.extent_cnt;
+  disk_sector_t sector;
+  size_t done;
+
+  inode->extent_cap = cnt > INLINE_EXTENTS ? cnt : INLINE_EXTENTS;
+  inode->extents = malloc (inode->extent_cap * sizeof *inode->extents);
+  if (inode->extents == NULL)
+    return false;
+  done = cnt < INLINE_EXTENTS ? cnt : INLINE_EXTENTS;
+  memcpy (inode->extents, inode->data.extents,
+          done * sizeof *inode->extents);
+
+  for (sector = inode->data.ext_next; sector != 0; ) 
+    {
+      const struct extent_block *eb;
+      disk_sector_t *chain;
+      size_t n = cnt - done < BLOCK_EXTENTS ? cnt - done : BLOCK_EXTENTS;
+
+      chain = realloc (inode->chain, (inode->chain_cnt + 1) * sizeof *chain);
+      if (chain == NULL)
+        return false;
+      inode->chain = chain;
+      chain[inode->chain_cnt++] = sector;
+
+      eb = cache_get (filesys_disk, sector, CACHE_META);
+      memcpy (inode->extents + done, eb->extents, n * sizeof *eb->extents);
+      sector = eb->next;
+      cache_put ((void *) eb, false);
+      done += n;
+    }
+  ASSERT (done == cnt);
+  return true;
+}
+
+/* Releases every sector mapped by INODE, and its extent blocks,
+   back to the free map. */
+static void
+release_extents (struct inode *inode) 
+{
+  size_t i;
+
+  for (i = 0; i < inode->data.extent_cnt; i++)
+    free_map_release (inode->extents[i].start, inode->extents[i].length);
+  for (i = 0; i < inode->chain_cnt; i++)
+    free_map_release (inode->chain[i], 1);
+  inode->data.extent_cnt = 0;
+  inode->chain_cnt = 0;
+}
+
+/* Makes room for one more extent in INODE and allocates up to
+   CNT consecutive sectors for it, to hold file blocks from BLOCK
+   on.  All CNT are asked of the free map in one piece first, and
+   smaller and smaller pieces only if that fails, so that data
+   ends up in as few extents as the free map allows.  The free
+   map is asked for sectors right after those of the block before
+   BLOCK, if it has any, or else in the data area of the inode's
+   allocation group, so that a file that grows can keep extending
+   its last extent and stays near its inode.  Stores the
+   first sector in *START and returns the number allocated, or 0
+   if memory or disk allocation fails. */
+static size_t
+allocate_run (struct inode *inode, uint32_t block, size_t cnt,
+              disk_sector_t *start) 
+{
+  disk_sector_t hint = free_map_data_hint (inode->sector);
+  size_t idx;
+
+  ASSERT (cnt > 0);
+  if (!extent_reserve (inode))
+    return 0;
+  idx = extent_find (inode, block);
+  if (idx > 0)
+    {
+      const struct extent *e = &inode->extents[idx - 1];
+      hint = e->start + e->length;
+    }
+  while (!free_map_allocate_near (cnt, hint, start)) 
+    {
+      if (cnt == 1)
+        return 0;
+      cnt /= 2;
+    }
+  return cnt;
+}
+
+/* Allocates zeroed sectors for file blocks BLOCK through
+   BLOCK + CNT - 1 of INODE, none of which may be mapped yet.
+   Returns false if memory or disk allocation fails, in which
+   case some of the blocks may have been allocated. */
+static bool
+allocate_blocks (struct inode *inode, uint32_t block, size_t cnt) 
+{
+  while (cnt > 0) 
+    {
+      disk_sector_t start;
+      size_t run = allocate_run (inode, block, cnt, &start);
+      size_t i;
+
+      if (run == 0)
+        return false;
+      for (i = 0; i < run; i++) 
+        {
+          void *data;
+
+          if (is_meta (inode)) 
+            {
+              data = cache_get (filesys_disk, start + i,
+                                meta_flags (start + i, CACHE_NEW));
+              memset (data, 0, DISK_SECTOR_SIZE);
+              meta_put (data);
+            }
+          else 
+            {
+              data = cache_get (filesys_disk, start + i,
+                                CACHE_WRITE | CACHE_NEW);
+              memset (data, 0, DISK_SECTOR_SIZE);
+              cache_put (data, true);
+            }
+        }
+      extent_add (inode, block, start, run);
+      block += run;
+      cnt -= run;
+    }
+  return true;
+}
+
+/* Returns the number of file blocks from BLOCK onward, up to but
+   not including END, that INODE has no sectors for yet. */
+static size_t
+hole_length (struct inode *inode, uint32_t block, uint32_t end) 
+{
+  size_t idx = extent_find (inode, block);
+
+  if (idx < inode->data.extent_cnt) 
+    {
+      const struct extent *e = &inode->extents[idx];
+      if (e->block <= block)
+        return 0;
+      if (e->block < end)
+        end = e->block;
+    }
+  return end > block ? end - block : 0;
+}
+
+/* Returns the part of INODE's delayed allocation buffer that
+   holds file block BLOCK, which has no sector.  If BLOCK is not
+   buffered yet, it is added, zeroed, if it extends the buffered
+   run, or starts a new run past every extent of INODE.  A sector
+   is reserved for each block added, so that delay_flush() will
+   find room for it.
+   Returns a null pointer if BLOCK cannot be buffered. */
+static uint8_t *
+delay_get (struct inode *inode, uint32_t block) 
+{
+  uint8_t *data;
+
+  if (is_meta (inode))
+    return NULL;
+  if (inode->delay_cnt > 0) 
+    {
+      if (block >= inode->delay_block
+          && block - inode->delay_block < inode->delay_cnt)
+        return inode->delay_buf
+               + (block - inode->delay_block) * DISK_SECTOR_SIZE;
+      if (block != inode->delay_block + inode->delay_cnt
+          || inode->delay_cnt >= DELAY_MAX)
+        return NULL;
+    }
+  else 
+    {
+      size_t cnt = inode->data.extent_cnt;
+      if (cnt > 0 && (inode->extents[cnt - 1].block
+                      + inode->extents[cnt - 1].length > block))
+        return NULL;
+      inode->delay_block = block;
+    }
+
+  if (inode->delay_buf == NULL) 
+    {
+      inode->delay_buf = malloc (DELAY_MAX * DISK_SECTOR_SIZE);
+      if (inode->delay_buf == NULL)
+        return NULL;
+    }
+  if (!free_map_reserve (1))
+    return NULL;
+  data = inode->delay_buf + inode->delay_cnt++ * DISK_SECTOR_SIZE;
+  memset (data, 0, DISK_SECTOR_SIZE);
+  return data;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Allocates sectors for the blocks in INODE's delayed allocation
+   buffer, as contiguously as the free map allows, and moves their
+   data into the buffer cache.  Returns false if memory
+   allocation fails, in which case the blocks not yet allocated
+   stay in the buffer. */
+static bool
+delay_flush (struct inode *inode) 
+{
+  size_t done = 0;
+
+  if (inode->delay_cnt == 0)
+    return true;
+
+  free_map_unreserve (inode->delay_cnt);
+  while (done < inode->delay_cnt) 
+    {
+      disk_sector_t start;
+      size_t run = allocate_run (inode, inode->delay_block + done,
+                                 inode->delay_cnt - done, &start);
+      size_t i;
+
+      if (run == 0)
+        break;
+      for (i = 0; i < run; i++) 
+        {
+          void *data = cache_get (filesys_disk, start + i,
+                                  CACHE_WRITE | CACHE_NEW);
+          memcpy (data, inode->delay_buf + (done + i) * DISK_SECTOR_SIZE,
+                  DISK_SECTOR_SIZE);
+          cache_put (data, true);
+        }
+      extent_add (inode, inode->delay_block + done, start, run);
+      done += run;
+    }
+
+  if (done > 0)
+    extents_store (inode);
+  inode->delay_block += done;
+  inode->delay_cnt -= done;
+  if (inode->delay_cnt == 0)
+    return true;
+  memmove (inode->delay_buf, inode->delay_buf + done * DISK_SECTOR_SIZE,
+           inode->delay_cnt * DISK_SECTOR_SIZE);
+  free_map_reserve (inode->delay_cnt);
+  return false;
+}
+
+/* A sector of zeros, which inode_pin_sector() hands out for the
+   blocks of a sparse file that have never been written. */
+static const uint8_t zero_sector[DISK_SECTOR_SIZE];
+
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  open_inodes_lock
+   protects the table and every inode's open_cnt, loading and
+   closing, and is not held across disk I/O: an inode stays in
+   the table, marked loading, while inode_open() reads it in,
+   and marked closing while the last inode_close() writes it
+   back, and anyone opening its sector meanwhile waits on
+   inode_settled. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+static struct condition inode_settled;  /* An inode loaded or closed. */
+
+/* Hash function for open_inodes. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders open_inodes entries by sector. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED) 
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table creation failed");
+  lock_init (&open_inodes_lock);
+  cond_init (&inode_settled);
+}
+
+/* Allocates sectors for every open inode's delayed blocks, so
+   that their data reaches disk when the buffer cache is closed.
+   Each inode is flushed in a journal operation of its own, so
+   that each fits in one transaction; they are taken in sector
+   order so that each is visited once. */
+void
+inode_done (void) 
+{
+  disk_sector_t next = 0;
+
+  for (;;)
+    {
+      struct hash_iterator i;
+      struct inode *inode = NULL;
+
+      /* Find the next inode with delayed blocks and keep it open.
+         DELAY_CNT is only a hint here; delay_flush() checks it
+         again under the inode's lock. */
+      journal_begin ();
+      lock_acquire (&open_inodes_lock);
+      hash_first (&i, &open_inodes);
+      while (hash_next (&i))
+        {
+          struct inode *e = hash_entry (hash_cur (&i), struct inode, elem);
+          if (!e->loading && !e->closing && e->delay_cnt > 0
+              && e->sector >= next
+              && (inode == NULL || e->sector < inode->sector))
+            inode = e;
+        }
+      if (inode != NULL)
+        inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      if (inode == NULL) 
+        {
+          journal_end ();
+          break;
+        }
+
+      rwlock_acquire_write (&inode->rw);
+      delay_flush (inode);
+      rwlock_release (&inode->rw);
+      next = inode->sector + 1;
+      inode_close (inode);
+      journal_end ();
+    }
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   disk.
+   disk.  The inode is a directory if IS_DIR is true.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
-inode_create (disk_sector_t sector, off_t length)
+inode_create (disk_sector_t sector, off_t length, bool is_dir)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -83,26 +709,25 @@ inode_create (disk_sector_t sector, off_t length)
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_block) == DISK_SECTOR_SIZE);
 
+  /* Blocks are not allocated until they are first written, so
+     the new inode is all there is to write. */
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start))
-        {
-          disk_write (filesys_disk, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[DISK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                disk_write (filesys_disk, disk_inode->start + i, zeros); 
-            }
-          success = true; 
-        } 
+      disk_inode->flags = is_dir ? INODE_DIR : 0;
+
+      /* Small regular files start out inline.  The free map is
+         metadata and never does. */
+      if (!is_dir && sector != FREE_MAP_SECTOR && length <= INLINE_SIZE)
+        disk_inode->flags |= INODE_INLINE;
+      journal_begin ();
+      write_meta (sector, disk_inode);
+      journal_end ();
+      success = true; 
       free (disk_inode);
     }
   return success;
@@ -114,33 +739,74 @@ inode_create (disk_sector_t sector, off_t length)
 struct inode *
 inode_open (disk_sector_t sector) 
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
+  bool success;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already open, waiting for it if
+     it is being read in or let go. */
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL) 
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->loading && !inode->closing) 
         {
-          inode_reopen (inode);
+          inode->open_cnt++;
+          lock_release (&open_inodes_lock);
           return inode; 
         }
+      cond_wait (&inode_settled, &open_inodes_lock);
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  inode->closing = false;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  disk_read (filesys_disk, inode->sector, &inode->data);
+  inode->read_end = 0;
+  inode->stream_cnt = 0;
+  inode->ahead_end = 0;
+  inode->extents = NULL;
+  inode->extent_hint = 0;
+  inode->chain = NULL;
+  inode->chain_cnt = 0;
+  inode->delay_cnt = 0;
+  inode->delay_buf = NULL;
+  rwlock_init (&inode->rw);
+  lock_init (&inode->lock);
+
+  /* Read it in with the table unlocked.  Anyone else opening
+     SECTOR meanwhile finds it loading and waits. */
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+  read_meta (inode->sector, &inode->data);
+  success = extents_load (inode);
+
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  if (!success)
+    hash_delete (&open_inodes, &inode->elem);
+  cond_broadcast (&inode_settled, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
+  if (!success) 
+    {
+      free (inode->extents);
+      free (inode->chain);
+      free (inode);
+      return NULL;
+    }
   return inode;
 }
 
@@ -149,7 +815,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -171,21 +841,75 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  journal_begin ();
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
-        {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
-        }
+      lock_release (&open_inodes_lock);
+      journal_end ();
+      return;
+    }
+
+  /* The inode stays in the table, marked closing, until it is
+     written back, so that nobody can open it again from a stale
+     disk copy; but the table is not locked meanwhile. */
+  inode->closing = true;
+  lock_release (&open_inodes_lock);
 
-      free (inode); 
+  /* Deallocate blocks if removed, otherwise give delayed blocks
+     their sectors. */
+  if (inode->removed) 
+    {
+      free_map_unreserve (inode->delay_cnt);
+      free_map_release (inode->sector, 1);
+      release_extents (inode);
     }
+  else
+    delay_flush (inode);
+
+  /* Remove from inode table. */
+  lock_acquire (&open_inodes_lock);
+  hash_delete (&open_inodes, &inode->elem);
+  cond_broadcast (&inode_settled, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
+
+  free (inode->delay_buf);
+  free (inode->extents);
+  free (inode->chain);
+  free (inode); 
+  journal_end ();
+}
+
+/* Returns true if INODE is a directory. */
+bool
+inode_is_dir (const struct inode *inode) 
+{
+  return (inode->data.flags & INODE_DIR) != 0;
+}
+
+/* Returns true if INODE has been removed, even though it is still
+   open. */
+bool
+inode_is_removed (const struct inode *inode) 
+{
+  return inode->removed;
+}
+
+/* Locks INODE for a change that takes several reads and writes,
+   such as adding or removing a directory entry, so that no other
+   such change comes between them.  Reads and writes of INODE
+   still work while it is locked. */
+void
+inode_lock (struct inode *inode) 
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Unlocks INODE, locked by inode_lock(). */
+void
+inode_unlock (struct inode *inode) 
+{
+  lock_release (&inode->lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -197,81 +921,261 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
-/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
-   Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
-off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+/* Updates INODE's sequential stream detection for a read
+   starting at OFFSET.  A read that picks up where the previous
+   one ended raises the stream count, which doubles the read-ahead
+   window; any other read is treated as random access and drops
+   the window to nothing. */
+static void
+detect_stream (struct inode *inode, off_t offset) 
+{
+  if (offset == inode->read_end)
+    {
+      if ((1 << inode->stream_cnt) <= READ_AHEAD_MAX)
+        inode->stream_cnt++;
+    }
+  else
+    {
+      inode->stream_cnt = 0;
+      inode->ahead_end = offset;
+    }
+}
+
+/* Asks the buffer cache to prefetch the sectors of INODE that
+   follow the last read, as far as the current stream window
+   reaches and no further than end of file, one run of
+   contiguous sectors at a time.  Sectors already requested by an
+   earlier call are not requested again. */
+static void
+read_ahead (struct inode *inode) 
+{
+  off_t window_end, pos;
+  size_t run, cnt;
+
+  if (inode->stream_cnt == 0)
+    return;
+
+  window_end = ROUND_UP (inode->read_end, DISK_SECTOR_SIZE)
+               + (DISK_SECTOR_SIZE << (inode->stream_cnt - 1));
+  if (window_end > inode_length (inode))
+    window_end = inode_length (inode);
+
+  pos = ROUND_UP (inode->read_end, DISK_SECTOR_SIZE);
+  if (pos < inode->ahead_end)
+    pos = inode->ahead_end;
+  for (; pos < window_end; pos += cnt * DISK_SECTOR_SIZE) 
+    {
+      disk_sector_t sector = byte_to_run (inode, pos, &run);
+      cnt = bytes_to_sectors (window_end - pos);
+      if (cnt > run)
+        cnt = run;
+      if (sector != (disk_sector_t) -1)
+        cache_read_ahead (filesys_disk, sector, cnt);
+    }
+  if (pos > inode->ahead_end)
+    inode->ahead_end = pos;
+}
+
+/* Moves the data of inline INODE into file block 0, held for
+   delayed allocation, so that INODE can grow past INLINE_SIZE
+   bytes.  Returns false if that fails, in which case INODE is
+   still inline. */
+static bool
+inline_migrate (struct inode *inode) 
+{
+  ASSERT (inode->data.flags & INODE_INLINE);
+  ASSERT (inode->data.extent_cnt == 0 && inode->delay_cnt == 0);
+
+  if (inode->data.length > 0) 
+    {
+      uint8_t *data = delay_get (inode, 0);
+      if (data == NULL)
+        return false;
+      memcpy (data, inode->data.inline_data, inode->data.length);
+    }
+  memset (inode->data.inline_data, 0, sizeof inode->data.inline_data);
+  inode->data.flags &= ~INODE_INLINE;
+  return true;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, for inode_read_at() and inode_readv_at().  INODE's lock
+   must be held. */
+static off_t
+read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+
+  if (inode->data.flags & INODE_INLINE) 
+    {
+      if (offset < inode->data.length) 
+        {
+          bytes_read = inode->data.length - offset;
+          if (bytes_read > size)
+            bytes_read = size;
+          memcpy (buffer, inode->data.inline_data + offset, bytes_read);
+        }
+      return bytes_read;
+    }
+
+  detect_stream (inode, offset);
 
   while (size > 0) 
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      disk_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* First disk sector of the run to read, number of sectors in
+         the run, starting byte offset within the first sector. */
+      size_t run;
+      disk_sector_t sector_idx = byte_to_run (inode, offset, &run);
       int sector_ofs = offset % DISK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
+      /* Bytes left in inode, bytes left in run, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      off_t run_left = (off_t) run * DISK_SECTOR_SIZE - sector_ofs;
+      off_t min_left = inode_left < run_left ? inode_left : run_left;
 
-      /* Number of bytes to actually copy out of this sector. */
-      int chunk_size = size < min_left ? size : min_left;
+      /* Number of bytes to actually copy out of this run. */
+      off_t chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
+      if (sector_idx == (disk_sector_t) -1)
         {
-          /* Read full sector directly into caller's buffer. */
-          disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
+          /* Held for delayed allocation, or never written and so
+             reads as zeros. */
+          uint32_t block = offset / DISK_SECTOR_SIZE;
+          if (inode->delay_cnt > 0 && block >= inode->delay_block
+              && block - inode->delay_block < inode->delay_cnt)
+            memcpy (buffer + bytes_read,
+                    delay_get (inode, block) + sector_ofs, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
         }
       else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (DISK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          disk_read (filesys_disk, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+        cache_read_at (filesys_disk, sector_idx, buffer + bytes_read,
+                       sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  inode->read_end = offset;
+  read_ahead (inode);
 
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
+   Returns the number of bytes actually read, which may be less
+   than SIZE if an error occurs or end of file is reached.
+   The range is read a run of contiguous sectors at a time, one
+   extent lookup and one buffer cache call for each, and the
+   cache reads the sectors it misses with as few disk reads as
+   it can.  Any number of reads of INODE may run at once. */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset) 
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset) 
+{
+  off_t bytes_read;
+
+  rwlock_acquire_read (&inode->rw);
+  bytes_read = read_at (inode, buffer, size, offset);
+  rwlock_release (&inode->rw);
+
+  return bytes_read;
+}
+
+/* Reads from INODE into the CNT pieces of memory described by
+   IOV, in order, starting at position OFFSET, as one read: no
+   write to INODE comes between the pieces.
+   Returns the number of bytes actually read, which may be less
+   than the total size of IOV if end of file is reached. */
+off_t
+inode_readv_at (struct inode *inode, const struct file_iovec *iov,
+                size_t cnt, off_t offset) 
+{
+  off_t bytes_read = 0;
+  size_t i;
+
+  rwlock_acquire_read (&inode->rw);
+  for (i = 0; i < cnt; i++) 
+    {
+      off_t n = read_at (inode, iov[i].base, iov[i].size,
+                         offset + bytes_read);
+      bytes_read += n;
+      if (n < iov[i].size)
+        break;
+    }
+  rwlock_release (&inode->rw);
+
+  return bytes_read;
+}
+
+/* Returns true if writing SIZE bytes at OFFSET in INODE would
+   only overwrite file data in sectors INODE already has, leaving
+   the inode itself, its extents and its delayed allocation
+   buffer alone.  INODE's lock must be held. */
+static bool
+overwrites_in_place (struct inode *inode, off_t offset, off_t size) 
+{
+  off_t end = offset + size;
+
+  if ((inode->data.flags & INODE_INLINE) || is_meta (inode)
+      || end > inode->data.length)
+    return false;
+  while (offset < end) 
+    {
+      size_t run;
+      if (byte_to_run (inode, offset, &run) == (disk_sector_t) -1)
+        return false;
+      offset = ROUND_DOWN (offset, DISK_SECTOR_SIZE)
+               + (off_t) run * DISK_SECTOR_SIZE;
+    }
+  return true;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   for inode_write_at() and inode_writev_at().  INODE's lock must
+   be held, exclusively unless overwrites_in_place(). */
+static off_t
+write_at (struct inode *inode, const void *buffer_, off_t size,
+          off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t old_length;
+  bool changed = false;
+  enum cache_flags flags;
+  uint8_t *data;
 
-  if (inode->deny_write_cnt)
-    return 0;
+  old_length = inode_length (inode);
+
+  /* An inline file stays inline as long as it fits. */
+  if (inode->data.flags & INODE_INLINE) 
+    {
+      if (offset + size <= INLINE_SIZE) 
+        {
+          memcpy (inode->data.inline_data + offset, buffer, size);
+          if (offset + size > old_length)
+            inode->data.length = offset + size;
+          extents_store (inode);
+          return size;
+        }
+      if (!inline_migrate (inode)) 
+        return 0;
+    }
+
+  /* Extend first, so that byte_to_sector() covers the new bytes. */
+  if (offset + size > old_length)
+    inode->data.length = offset + size;
 
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      disk_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* First sector of the run to write, number of sectors in the
+         run, starting byte offset within the first sector. */
+      size_t run;
+      disk_sector_t sector_idx = byte_to_run (inode, offset, &run);
       int sector_ofs = offset % DISK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -284,30 +1188,61 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
-        {
-          /* Write full sector directly to disk. */
-          disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-        }
-      else 
+      if (sector_idx == (disk_sector_t) -1) 
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
+          uint32_t block = offset / DISK_SECTOR_SIZE;
+          uint32_t end;
+          bool ok;
+
+          /* Buffer the block if it can be, flushing a full buffer
+             to make room. */
+          data = delay_get (inode, block);
+          if (data == NULL && inode->delay_cnt > 0 && delay_flush (inode))
+            data = delay_get (inode, block);
+          if (data != NULL) 
             {
-              bounce = malloc (DISK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
+              memcpy (data + sector_ofs, buffer + bytes_written, chunk_size);
+              size -= chunk_size;
+              offset += chunk_size;
+              bytes_written += chunk_size;
+              continue;
             }
 
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            disk_read (filesys_disk, sector_idx, bounce);
-          else
-            memset (bounce, 0, DISK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          disk_write (filesys_disk, sector_idx, bounce); 
+          /* Allocate the whole hole up to the end of the write. */
+          end = DIV_ROUND_UP (offset + size, DISK_SECTOR_SIZE);
+          if (inode->delay_cnt > 0 && block < inode->delay_block
+              && end > inode->delay_block)
+            end = inode->delay_block;
+          ok = allocate_blocks (inode, block, hole_length (inode, block, end));
+          changed = true;
+          sector_idx = byte_to_run (inode, offset, &run);
+          if (!ok && sector_idx == (disk_sector_t) -1)
+            break;
+        }
+
+      if (is_meta (inode)) 
+        {
+          /* Patch the cached sector in place, in the journal's
+             transaction.  If the chunk covers the whole sector
+             there is no need to read it in first. */
+          flags = 0;
+          if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE)
+            flags |= CACHE_NEW;
+          data = cache_get (filesys_disk, sector_idx,
+                            meta_flags (sector_idx, flags));
+          memcpy (data + sector_ofs, buffer + bytes_written, chunk_size);
+          meta_put (data);
+        }
+      else 
+        {
+          /* File data: write as much of the run as the write
+             covers with one buffer cache call. */
+          off_t run_left = (off_t) run * DISK_SECTOR_SIZE - sector_ofs;
+          chunk_size = size < inode_left ? size : inode_left;
+          if (chunk_size > run_left)
+            chunk_size = run_left;
+          cache_write_at (filesys_disk, sector_idx, buffer + bytes_written,
+                          sector_ofs, chunk_size);
         }
 
       /* Advance. */
@@ -315,11 +1250,175 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* If the disk filled up, extend only as far as we got. */
+  if (inode->data.length > old_length) 
+    {
+      if (inode->data.length > offset)
+        inode->data.length = offset > old_length ? offset : old_length;
+      changed = changed || inode->data.length != old_length;
+    }
+  if (changed)
+    extents_store (inode);
 
   return bytes_written;
 }
 
+/* Locks INODE for writing SIZE bytes at OFFSET.  Overwriting
+   sectors INODE already has can share INODE with readers and
+   other such writers; any other write changes INODE and has to
+   have it to itself. */
+static void
+lock_for_write (struct inode *inode, off_t offset, off_t size) 
+{
+  rwlock_acquire_read (&inode->rw);
+  if (!overwrites_in_place (inode, offset, size)) 
+    {
+      rwlock_release (&inode->rw);
+      rwlock_acquire_write (&inode->rw);
+    }
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if the disk fills up or an error occurs.
+   Writing past end of file extends INODE.  A small file's data
+   stays in its inode until it grows past INLINE_SIZE.  Blocks of
+   a regular file appended past the last allocated block are held in
+   INODE's delayed allocation buffer and only get sectors, all
+   together, when it fills up or INODE is closed.  Other blocks
+   that have no sector yet get one now, along with any other
+   unallocated blocks the write covers, so that they are placed
+   together.  File data is written a run of contiguous sectors
+   at a time; writes to metadata go sector by sector and are
+   journaled. */
+off_t
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
+                off_t offset) 
+{
+  off_t bytes_written;
+
+  if (inode->deny_write_cnt || size <= 0)
+    return 0;
+
+  journal_begin ();
+  lock_for_write (inode, offset, size);
+  bytes_written = write_at (inode, buffer, size, offset);
+  rwlock_release (&inode->rw);
+  journal_end ();
+
+  return bytes_written;
+}
+
+/* Writes the CNT pieces of memory described by IOV, in order,
+   into INODE, starting at OFFSET, as one write: no other read or
+   write of INODE sees some of the pieces without the rest.
+   Returns the number of bytes actually written, which may be
+   less than the total size of IOV if the disk fills up or an
+   error occurs. */
+off_t
+inode_writev_at (struct inode *inode, const struct file_const_iovec *iov,
+                 size_t cnt, off_t offset) 
+{
+  off_t bytes_written = 0;
+  off_t size = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    size += iov[i].size;
+  if (inode->deny_write_cnt || size <= 0)
+    return 0;
+
+  journal_begin ();
+  lock_for_write (inode, offset, size);
+  for (i = 0; i < cnt; i++) 
+    {
+      off_t n;
+
+      if (iov[i].size <= 0)
+        continue;
+      n = write_at (inode, iov[i].base, iov[i].size, offset + bytes_written);
+      bytes_written += n;
+      if (n < iov[i].size)
+        break;
+    }
+  rwlock_release (&inode->rw);
+  journal_end ();
+
+  return bytes_written;
+}
+
+/* Allocates zeroed sectors for every block of INODE's first
+   LENGTH bytes that does not have one, and extends INODE to
+   LENGTH bytes if it is shorter.  For files that must never be
+   sparse, such as the free map, whose blocks cannot be allocated
+   while the free map itself is being written.
+   Returns false if memory or disk allocation fails. */
+bool
+inode_reserve (struct inode *inode, off_t length) 
+{
+  uint32_t end = bytes_to_sectors (length);
+  uint32_t block;
+  bool success;
+
+  journal_begin ();
+  rwlock_acquire_write (&inode->rw);
+  success = delay_flush (inode);
+
+  for (block = 0; success && block < end; block++)
+    {
+      size_t cnt = hole_length (inode, block, end);
+      if (cnt > 0)
+        {
+          success = allocate_blocks (inode, block, cnt);
+          block += cnt - 1;
+        }
+    }
+  if (success && inode->data.length < length)
+    inode->data.length = length;
+  extents_store (inode);
+  rwlock_release (&inode->rw);
+  journal_end ();
+  return success;
+}
+
+/* Pins the sector of INODE that holds byte OFFSET in the buffer
+   cache and returns a pointer to its first byte, so that the
+   caller can read it in place.  Returns a null pointer if OFFSET
+   is at or past end of file.  The caller must release the sector
+   with inode_unpin_sector(). */
+const void *
+inode_pin_sector (struct inode *inode, off_t offset) 
+{
+  disk_sector_t sector;
+
+  ASSERT (!(inode->data.flags & INODE_INLINE));
+  if (offset >= inode_length (inode))
+    return NULL;
+  if (inode->delay_cnt > 0) 
+    {
+      journal_begin ();
+      rwlock_acquire_write (&inode->rw);
+      delay_flush (inode);
+      rwlock_release (&inode->rw);
+      journal_end ();
+    }
+  rwlock_acquire_read (&inode->rw);
+  sector = byte_to_sector (inode, offset);
+  rwlock_release (&inode->rw);
+  if (sector == (disk_sector_t) -1)
+    return zero_sector;
+  return cache_get (filesys_disk, sector, 0);
+}
+
+/* Releases a sector returned by inode_pin_sector(). */
+void
+inode_unpin_sector (const void *sector) 
+{
+  if (sector != zero_sector)
+    cache_put ((void *) sector, false);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
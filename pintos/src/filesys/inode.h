@@ -2,20 +2,35 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
 
 struct bitmap;
+struct file_iovec;
+struct file_const_iovec;
 
 void inode_init (void);
-bool inode_create (disk_sector_t, off_t);
+void inode_done (void);
+bool inode_create (disk_sector_t, off_t, bool is_dir);
 struct inode *inode_open (disk_sector_t);
 struct inode *inode_reopen (struct inode *);
 disk_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_lock (struct inode *);
+void inode_unlock (struct inode *);
+bool inode_is_dir (const struct inode *);
+bool inode_is_removed (const struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_readv_at (struct inode *, const struct file_iovec *, size_t cnt,
+                      off_t offset);
+off_t inode_writev_at (struct inode *, const struct file_const_iovec *,
+                       size_t cnt, off_t offset);
+bool inode_reserve (struct inode *, off_t length);
+const void *inode_pin_sector (struct inode *, off_t offset);
+void inode_unpin_sector (const void *);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
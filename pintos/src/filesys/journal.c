@@ -0,0 +1,462 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <round.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Metadata journal.
+
+   Operations that change file system metadata (inodes, extent
+   blocks, directories and the free map) run between
+   journal_begin() and journal_end().  Each metadata sector they
+   write joins the running transaction, and the buffer cache
+   holds it, neither writing it back nor evicting it, until the
+   transaction commits.  Any number of operations share one
+   transaction.
+
+   A commit waits until no operation is in progress and then
+   writes the transaction's sectors to the log, followed by the
+   journal header naming the transaction, which is the commit
+   point.  After that the cache writes the sectors in place
+   whenever it likes.  Before the next commit reuses the log it
+   writes in place any it has not: from the cache, or, for those
+   the running transaction has changed again and so holds, from
+   the log.  So at any moment the disk holds, in place or in the
+   log named by the header, the metadata as of the last commit,
+   and filesys_init() replays the log to get it back after a
+   crash.  File data is not journaled.
+
+   Each operation sets aside room for JOURNAL_OP_MAX sectors
+   when it begins, waiting, or committing the transaction, until
+   there is that much room besides what the operations already
+   under way have set aside.  So an operation that stays within
+   JOURNAL_OP_MAX sectors always commits as a whole.  Directory
+   growth is capped to stay within it (see directory.c), and
+   inode_done() flushes one inode per operation.  The one kind of
+   operation that can go over is one that changes the extents of
+   a file so fragmented that rewriting its extent blocks, which
+   extents_store() does all at once, takes more sectors than
+   that.  If that fills the transaction, the next sector written commits it at
+   once, without waiting for the operations under way to end, so
+   each of them commits in pieces and a crash may keep only part
+   of it.  Such a commit only waits for sectors already being
+   written, between journal_dirty() and journal_written(), so
+   that it logs no change half made.
+
+   The journal occupies JOURNAL_SECTORS sectors from
+   JOURNAL_SECTOR on: the header, a descriptor that lists the
+   sectors of the logged transaction, and their contents. */
+
+/* Identifies the journal header and descriptor. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* On-disk journal header.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Last transaction committed. */
+    uint32_t cnt;                       /* Sectors to replay, 0 if none. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+/* On-disk descriptor of the logged transaction.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_desc
+  {
+    unsigned magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Transaction logged. */
+    uint32_t cnt;                       /* Number of sectors logged. */
+    disk_sector_t sectors[JOURNAL_TXN_MAX]; /* Where each one belongs. */
+  };
+
+/* journal_lock protects everything below except the sector
+   arrays, which a commit has to itself. */
+static struct lock journal_lock;
+static struct condition journal_idle;   /* Operations or a commit ended. */
+static int handle_cnt;                  /* Operations in progress. */
+static int writing_cnt;                 /* Sectors being written. */
+static bool committing;                 /* A commit is under way. */
+static struct thread *committer;        /* Thread doing it. */
+static bool commit_wanted;              /* journal_commit() is waiting. */
+static uint32_t seq;                    /* Last transaction committed. */
+
+/* The running transaction: metadata sectors written since the
+   last commit, which the cache holds.  Operations fill it to
+   TXN_CAP; the commit itself may add the free map's sectors,
+   for which journal_init() leaves room up to JOURNAL_TXN_MAX. */
+static disk_sector_t txn[JOURNAL_TXN_MAX];
+static size_t txn_cnt;
+static size_t txn_cap;
+
+/* The sectors of the last committed transaction, which may not
+   have been written in place yet. */
+static disk_sector_t logged[JOURNAL_TXN_MAX];
+static size_t logged_cnt;
+
+/* Buffers for journal I/O, used by one commit at a time. */
+static struct journal_header header;
+static struct journal_desc desc;
+static uint8_t log_buf[DISK_SECTOR_SIZE];
+
+static void replay (void);
+static void commit (void);
+static void write_header (uint32_t cnt);
+static void journal_thread (void *aux);
+
+/* Initializes the journal.  If FORMAT is true, creates an empty
+   journal; otherwise replays the existing one. */
+void
+journal_init (bool format)
+{
+  size_t free_map_sectors;
+
+  ASSERT (sizeof header == DISK_SECTOR_SIZE);
+  ASSERT (sizeof desc == DISK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&journal_idle);
+  handle_cnt = writing_cnt = 0;
+  committing = commit_wanted = false;
+  committer = NULL;
+  txn_cnt = logged_cnt = 0;
+
+  /* Held sectors cannot be evicted, so a transaction must leave
+     the cache room to work, and it must leave the log room for
+     every sector of the free map, which each commit may add,
+     and the free map's inode, to be safe.  It must hold at least
+     one operation. */
+  free_map_sectors = DIV_ROUND_UP (disk_size (filesys_disk),
+                                   DISK_SECTOR_SIZE * 8) + 1;
+  txn_cap = cache_size () / 2;
+  if (txn_cap + free_map_sectors > JOURNAL_TXN_MAX)
+    txn_cap = (free_map_sectors < JOURNAL_TXN_MAX
+               ? JOURNAL_TXN_MAX - free_map_sectors : 0);
+  if (txn_cap < JOURNAL_OP_MAX)
+    PANIC ("disk too large for the journal");
+
+  if (format)
+    {
+      seq = 0;
+      write_header (0);
+    }
+  else
+    replay ();
+
+  if (!cache_write_through && cache_flush_ticks > 0)
+    thread_create ("journal", PRI_DEFAULT, journal_thread, NULL);
+}
+
+/* Commits the running transaction and writes what it logged in
+   place, so that the next mount has nothing to replay. */
+void
+journal_close (void)
+{
+  struct thread *t = thread_current ();
+
+  /* Commit, and keep any later operation from starting. */
+  ASSERT (t->journal_depth == 0);
+  t->journal_depth++;
+  lock_acquire (&journal_lock);
+  while (committing || handle_cnt > 0)
+    cond_wait (&journal_idle, &journal_lock);
+  commit ();
+  committing = true;
+  lock_release (&journal_lock);
+  t->journal_depth--;
+
+  if (cache_flush_sectors (filesys_disk, logged, logged_cnt) != 0)
+    PANIC ("journal: logged sector still held at close");
+  logged_cnt = 0;
+  write_header (0);
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Starts an operation that changes metadata, with room for
+   JOURNAL_OP_MAX sectors in the running transaction.  Waits while
+   a commit is under way or due, or while the operations under
+   way leave too little room, committing if none is.  Operations
+   nest: only the outermost call in a thread counts, so that an
+   operation built from others commits as a whole.  Must be called before taking
+   any file system lock, because it may wait for other operations
+   to end. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (committing || commit_wanted
+         || txn_cnt + (handle_cnt + 1) * JOURNAL_OP_MAX > txn_cap)
+    {
+      if (!committing && handle_cnt == 0)
+        commit ();
+      else
+        cond_wait (&journal_idle, &journal_lock);
+    }
+  handle_cnt++;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation started by journal_begin().  In write-through
+   mode the end of the outermost operation commits it. */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  if (--handle_cnt == 0 && cache_write_through)
+    {
+      t->journal_depth++;
+      commit ();
+      t->journal_depth--;
+    }
+  cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Returns true if SECTOR is in the running transaction. */
+static bool
+txn_has (disk_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < txn_cnt; i++)
+    if (txn[i] == sector)
+      return true;
+  return false;
+}
+
+/* Adds metadata sector SECTOR, which the caller is about to
+   write with CACHE_HOLD, to the running transaction.  If the
+   transaction is full, which only an operation that goes over
+   JOURNAL_OP_MAX sectors can bring about, commits it first.  Must be called within
+   an operation, and followed by journal_written() once the
+   sector is written and put back. */
+void
+journal_dirty (disk_sector_t sector)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  if (committer != t)
+    for (;;)
+      {
+        if (committing)
+          cond_wait (&journal_idle, &journal_lock);
+        else if (txn_cnt < txn_cap || txn_has (sector))
+          break;
+        else if (writing_cnt == 0)
+          commit ();
+        else
+          cond_wait (&journal_idle, &journal_lock);
+      }
+  if (!txn_has (sector))
+    {
+      /* Only the committer goes past TXN_CAP, and only with the
+         free map, which journal_init() left room for. */
+      ASSERT (txn_cnt < JOURNAL_TXN_MAX);
+      txn[txn_cnt++] = sector;
+    }
+  writing_cnt++;
+  lock_release (&journal_lock);
+}
+
+/* Tells the journal that the sector passed to the last
+   journal_dirty() has been written and put back. */
+void
+journal_written (void)
+{
+  lock_acquire (&journal_lock);
+  ASSERT (writing_cnt > 0);
+  if (--writing_cnt == 0)
+    cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction, waiting for the operations
+   in progress to end first. */
+void
+journal_commit (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth == 0);
+  t->journal_depth++;
+  lock_acquire (&journal_lock);
+  commit_wanted = true;
+  while (committing || handle_cnt > 0)
+    cond_wait (&journal_idle, &journal_lock);
+  if (commit_wanted)
+    commit ();
+  lock_release (&journal_lock);
+  t->journal_depth--;
+}
+
+/* qsort() comparison that orders sector numbers. */
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const disk_sector_t *a = a_;
+  const disk_sector_t *b = b_;
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Commits the running transaction.  Must be called with
+   journal_lock held, from within an operation of the current
+   thread's own (so that the free map can be written), while no
+   commit is in progress and no sector is being written.  Other
+   operations may be in progress only if the transaction is full.
+   Drops journal_lock meanwhile; operations that begin, or write
+   a sector, wait for the commit to end. */
+static void
+commit (void)
+{
+  size_t held_cnt;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+  ASSERT (thread_current ()->journal_depth > 0);
+  ASSERT (!committing && writing_cnt == 0);
+
+  committing = true;
+  committer = thread_current ();
+  if (handle_cnt <= 1)
+    commit_wanted = false;
+  lock_release (&journal_lock);
+
+  /* Bring the free map's changes into the transaction. */
+  free_map_sync ();
+
+  if (txn_cnt > 0)
+    {
+      qsort (txn, txn_cnt, sizeof *txn, compare_sectors);
+
+      /* The log is about to be overwritten, so whatever the last
+         transaction has not yet written in place must go now.
+         The cache holds those this transaction has changed
+         again, with their new contents, so write their logged
+         contents in place from the log.  A held sector that this
+         transaction does not have would be a bug, and would be
+         lost. */
+      held_cnt = cache_flush_sectors (filesys_disk, logged, logged_cnt);
+      for (i = 0; i < logged_cnt; i++)
+        if (bsearch (&logged[i], txn, txn_cnt, sizeof *txn,
+                     compare_sectors) != NULL) 
+          {
+            disk_read (filesys_disk, JOURNAL_SECTOR + 2 + i, log_buf);
+            disk_write (filesys_disk, logged[i], log_buf);
+            held_cnt--;
+          }
+      if (held_cnt != 0)
+        PANIC ("journal: logged sector held outside the transaction");
+
+      /* Log the sectors, then commit by naming them in the
+         header. */
+      memset (&desc, 0, sizeof desc);
+      desc.magic = JOURNAL_MAGIC;
+      desc.seq = seq + 1;
+      desc.cnt = txn_cnt;
+      memcpy (desc.sectors, txn, txn_cnt * sizeof *txn);
+      disk_write (filesys_disk, JOURNAL_SECTOR + 1, &desc);
+      for (i = 0; i < txn_cnt; i++)
+        {
+          cache_read (filesys_disk, txn[i], log_buf);
+          disk_write (filesys_disk, JOURNAL_SECTOR + 2 + i, log_buf);
+        }
+      seq++;
+      write_header (txn_cnt);
+
+      /* Let the cache write them in place. */
+      cache_release (txn, txn_cnt);
+      if (cache_write_through)
+        cache_flush_sectors (filesys_disk, txn, txn_cnt);
+      memcpy (logged, txn, txn_cnt * sizeof *txn);
+      logged_cnt = txn_cnt;
+      txn_cnt = 0;
+    }
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  committer = NULL;
+  cond_broadcast (&journal_idle, &journal_lock);
+}
+
+/* Writes the journal header, saying that the CNT sectors of the
+   logged transaction are to be replayed after a crash. */
+static void
+write_header (uint32_t cnt)
+{
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.seq = seq;
+  header.cnt = cnt;
+  disk_write (filesys_disk, JOURNAL_SECTOR, &header);
+}
+
+/* Writes the committed transaction in the log, if any, in place.
+   Runs before anything else reads the disk, so it writes around
+   the buffer cache. */
+static void
+replay (void)
+{
+  uint32_t i;
+
+  disk_read (filesys_disk, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    PANIC ("journal not found--format the disk with -f");
+  seq = header.seq;
+  if (header.cnt == 0)
+    return;
+
+  /* A descriptor for a later transaction means that a commit of
+     it was cut short, after the one named in the header had been
+     written in place. */
+  disk_read (filesys_disk, JOURNAL_SECTOR + 1, &desc);
+  if (desc.magic == JOURNAL_MAGIC && desc.seq == header.seq
+      && desc.cnt == header.cnt && desc.cnt <= JOURNAL_TXN_MAX)
+    {
+      printf ("Replaying journal: %u sectors...", (unsigned) desc.cnt);
+      for (i = 0; i < desc.cnt; i++)
+        {
+          disk_read (filesys_disk, JOURNAL_SECTOR + 2 + i, log_buf);
+          disk_write (filesys_disk, desc.sectors[i], log_buf);
+        }
+      printf ("done.\n");
+    }
+  write_header (0);
+}
+
+/* Journal thread: commits the running transaction periodically,
+   which bounds how long a finished operation may go unlogged. */
+static void
+journal_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (cache_flush_ticks);
+      journal_commit ();
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Most metadata sectors one transaction can log. */
+#define JOURNAL_TXN_MAX 125
+
+/* Most metadata sectors, besides the free map's, that one
+   operation may change.  journal_begin() sets this much room
+   aside in the running transaction for each operation. */
+#define JOURNAL_OP_MAX 16
+
+/* Sectors taken by the journal, starting at JOURNAL_SECTOR:
+   its header, a descriptor and the logged sectors. */
+#define JOURNAL_SECTORS (2 + JOURNAL_TXN_MAX)
+
+void journal_init (bool format);
+void journal_close (void);
+void journal_begin (void);
+void journal_end (void);
+void journal_dirty (disk_sector_t);
+void journal_written (void);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
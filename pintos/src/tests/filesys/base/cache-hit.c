@@ -0,0 +1,69 @@
+/* Exercises buffer cache hits.  Writes a large "cold" file so
+   that the cache fills and the sectors of a small "hot" file land
+   behind many other slots, then re-reads the hot file many times
+   and checks what it reads back.  "hot" is closed and reopened
+   before the re-reads, so that its blocks leave the inode's
+   delayed allocation buffer for the cache, and every one of the
+   4000 sector reads that follow is a cache hit.  cache-hit.ck
+   checks that the "Cache: N hits" line printed at shutdown
+   counts at least that many.
+
+   This counts hits; it does not time them, since user programs
+   have no clock.  Running it with the kernel option
+   -cache-size=N set to 32, 512 and 4096 shows that the hits hold
+   up as the cache grows. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define COLD_SIZE (1000 * 512)
+#define HOT_SIZE (8 * 512)
+#define HOT_PASSES 500
+
+static char cold[COLD_SIZE];
+static char hot[HOT_SIZE];
+
+void
+test_main (void) 
+{
+  char block[512];
+  int cold_fd, hot_fd;
+  int pass;
+  size_t ofs;
+
+  random_init (0);
+  random_bytes (cold, sizeof cold);
+  random_bytes (hot, sizeof hot);
+
+  CHECK (create ("cold", 0), "create \"cold\"");
+  CHECK ((cold_fd = open ("cold")) > 1, "open \"cold\"");
+  msg ("write \"cold\"");
+  if (write (cold_fd, cold, sizeof cold) != sizeof cold)
+    fail ("write \"cold\" failed");
+  msg ("close \"cold\"");
+  close (cold_fd);
+
+  CHECK (create ("hot", 0), "create \"hot\"");
+  CHECK ((hot_fd = open ("hot")) > 1, "open \"hot\"");
+  msg ("write \"hot\"");
+  if (write (hot_fd, hot, sizeof hot) != sizeof hot)
+    fail ("write \"hot\" failed");
+  msg ("close \"hot\"");
+  close (hot_fd);
+  CHECK ((hot_fd = open ("hot")) > 1, "reopen \"hot\"");
+
+  msg ("re-read \"hot\" %d times", HOT_PASSES);
+  for (pass = 0; pass < HOT_PASSES; pass++)
+    for (ofs = 0; ofs < sizeof hot; ofs += sizeof block)
+      {
+        seek (hot_fd, ofs);
+        if (read (hot_fd, block, sizeof block) != sizeof block)
+          fail ("read %zu bytes at offset %zu failed", sizeof block, ofs);
+        compare_bytes (block, hot + ofs, sizeof block, ofs, "hot");
+      }
+
+  msg ("close \"hot\"");
+  close (hot_fd);
+}
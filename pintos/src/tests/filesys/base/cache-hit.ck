@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-hit) begin
+(cache-hit) create "cold"
+(cache-hit) open "cold"
+(cache-hit) write "cold"
+(cache-hit) close "cold"
+(cache-hit) create "hot"
+(cache-hit) open "hot"
+(cache-hit) write "hot"
+(cache-hit) close "hot"
+(cache-hit) reopen "hot"
+(cache-hit) re-read "hot" 500 times
+(cache-hit) close "hot"
+(cache-hit) end
+EOF
+
+# Every re-read of "hot" must have been a buffer cache hit.
+my ($hits) = map (/^Cache: (\d+) hits/, read_text_file ("$test.output"));
+fail "no \"Cache: N hits\" line in output\n" if !defined $hits;
+fail "only $hits cache hits, expected at least 4000\n" if $hits < 4000;
+pass;
@@ -31,6 +31,7 @@
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -240,6 +241,22 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-wt"))
+        cache_write_through = true;
+      else if (!strcmp (name, "-flush"))
+        cache_flush_ticks = atoi (value);
+      else if (!strcmp (name, "-cache-size"))
+        cache_sectors = atoi (value);
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value != NULL && !strcmp (value, "clock"))
+            cache_policy = CACHE_CLOCK;
+          else if (value != NULL && !strcmp (value, "2q"))
+            cache_policy = CACHE_2Q;
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)",
+                   value != NULL ? value : "");
+        }
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
@@ -294,6 +311,7 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"put", 2, fsutil_put},
       {"get", 2, fsutil_get},
+      {"cache-stats", 1, fsutil_cache_stats},
 #endif
       {NULL, 0, NULL},
     };
@@ -343,11 +361,18 @@ usage (void)
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  put FILE           Put FILE into file system from scratch disk.\n"
           "  get FILE           Get FILE from file system into scratch disk.\n"
+          "  cache-stats        Print buffer cache statistics so far.\n"
 #endif
           "\nOptions:\n"
           "  -h                 Print this help message and power off.\n"
           "  -q                 Power off VM after actions or on panic.\n"
           "  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+          "  -wt                Use a write-through buffer cache.\n"
+          "  -flush=TICKS       Write dirty cache sectors back every TICKS.\n"
+          "  -cache=POLICY      Use buffer cache POLICY: clock or 2q.\n"
+          "  -cache-size=N      Cache N disk sectors (default: 1/64 of RAM).\n"
+#endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
@@ -390,6 +415,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   disk_print_stats ();
+  cache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -453,6 +453,95 @@ cond_broadcast (struct condition *cond, struct lock *lock)
     cond_signal (cond, lock);
 }
 
+/* Initializes RWLOCK.  A readers-writer lock may be held by any
+   number of threads at once in shared ("read") mode, or by a
+   single thread in exclusive ("write") mode.  A thread waiting
+   for exclusive mode keeps new readers out, so that a steady
+   stream of readers cannot starve it.  For the same reason a
+   thread must not acquire a readers-writer lock it already
+   holds, in either mode. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->changed);
+  rwlock->reader_cnt = 0;
+  rwlock->writer_wait_cnt = 0;
+  rwlock->writer = NULL;
+}
+
+/* Acquires RWLOCK in shared mode, sleeping while another thread
+   holds it, or waits to hold it, in exclusive mode.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  while (rwlock->writer != NULL || rwlock->writer_wait_cnt > 0)
+    cond_wait (&rwlock->changed, &rwlock->lock);
+  rwlock->reader_cnt++;
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK in exclusive mode, sleeping until no other
+   thread holds it in either mode.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer_wait_cnt++;
+  while (rwlock->writer != NULL || rwlock->reader_cnt > 0)
+    cond_wait (&rwlock->changed, &rwlock->lock);
+  rwlock->writer_wait_cnt--;
+  rwlock->writer = thread_current ();
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread must hold, in
+   whichever mode it holds it. */
+void
+rwlock_release (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  if (rwlock->writer == thread_current ())
+    rwlock->writer = NULL;
+  else
+    {
+      ASSERT (rwlock->reader_cnt > 0);
+      rwlock->reader_cnt--;
+    }
+  if (rwlock->writer == NULL && rwlock->reader_cnt == 0)
+    cond_broadcast (&rwlock->changed, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Returns true if the current thread holds RWLOCK in exclusive
+   mode, false otherwise.  (Shared holders are not tracked.) */
+bool
+rwlock_held_by_current_thread (const struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  return rwlock->writer == thread_current ();
+}
+
 bool
 compare_lock_priority (struct list_elem * a, struct list_elem * b, void * aux UNUSED)
 {
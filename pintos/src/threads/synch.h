@@ -43,6 +43,22 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 bool compare_wait_priority(struct list_elem *, struct list_elem *, void *);
+
+/* Readers-writer lock. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition changed;   /* Signaled when the lock is released. */
+    int reader_cnt;             /* Threads holding it shared. */
+    int writer_wait_cnt;        /* Threads waiting to hold it exclusively. */
+    struct thread *writer;      /* Thread holding it exclusively, if any. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release (struct rwlock *);
+bool rwlock_held_by_current_thread (const struct rwlock *);
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
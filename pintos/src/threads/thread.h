@@ -99,6 +99,10 @@ struct thread
 		struct list_elem ELEM;							/* list element of created thread*/
 		struct list lock_list;							/* LIst of lock that current have */
 		struct lock * locker;									/* Lock which waiting for */
+#ifdef FILESYS
+    struct dir *cwd;                    /* Working directory, null for root. */
+    int journal_depth;                  /* Nesting of journal_begin(). */
+#endif
 		
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
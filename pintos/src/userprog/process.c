@@ -55,7 +55,7 @@ process_execute (const char *file_name)
 	{
 		return -1;
 	}
-	free(f);
+	file_close(f);
 	
   /* Create a new thread to execute FILE_NAME. */
   tid = thread_create (name_copy, PRI_DEFAULT, start_process, fn_copy);
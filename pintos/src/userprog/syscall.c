@@ -1,17 +1,19 @@
 #include "userprog/syscall.h"
 #include "userprog/process.h"
+#include "userprog/pagedir.h"
 #include <stdio.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "filesys/directory.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
+#include "filesys/inode.h"
 #include <list.h>
 #include "devices/input.h"
 static void syscall_handler (struct intr_frame *);
-static struct semaphore sema_file;
 void s_halt(void);
 void s_exit(int status);
 tid_t s_exec(char * cmd_line);
@@ -25,12 +27,18 @@ int s_write(int fd, const void * buffer, unsigned size);
 void s_seek(int fd, unsigned position);
 unsigned s_tell(int fd);
 void s_close(int fd);
+bool s_chdir(const char *dir);
+bool s_mkdir(const char *dir);
+bool s_readdir(int fd, char *name);
+bool s_isdir(int fd);
+int s_inumber(int fd);
+static struct file *fd_file(int fd);
+static void check_buffer(const void *buffer, unsigned size);
 
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-	sema_init(&sema_file, 1);
 }
 
 static void
@@ -85,6 +93,21 @@ syscall_handler (struct intr_frame *f UNUSED)
 		case SYS_CLOSE:
 			s_close(*(int *)(p+4));
 			break;
+		case SYS_CHDIR:
+			f->eax = s_chdir((const char *)*(int *)(p+4));
+			break;
+		case SYS_MKDIR:
+			f->eax = s_mkdir((const char *)*(int *)(p+4));
+			break;
+		case SYS_READDIR:
+			f->eax = s_readdir(*(int *)(p+4), (char *)*(int *)(p+8));
+			break;
+		case SYS_ISDIR:
+			f->eax = s_isdir(*(int *)(p+4));
+			break;
+		case SYS_INUMBER:
+			f->eax = s_inumber(*(int *)(p+4));
+			break;
 	}
 		
 }
@@ -179,6 +202,7 @@ s_read(int fd, void * buffer, unsigned size)
 		len = input_getc();
 	if(fd ==1)
 		return 0;
+	check_buffer(buffer, size);
 	len = file_read(thread_current()->file_list[fd], buffer, size);
 	return len;
 }
@@ -194,7 +218,10 @@ s_write(int fd, const void * buffer, unsigned size)
 	}
 	else if(fd==0)
 		return 0; 
+	if(s_isdir(fd))
+		return -1;
 	
+	check_buffer(buffer, size);
 	len = file_write(thread_current()->file_list[fd], buffer, (int32_t)size);
 	return len;
 }
@@ -222,3 +249,84 @@ s_close(int fd)
 	thread_current()->file_list[fd] = NULL;	
 
 }
+
+/* Exits the process unless the SIZE bytes at BUFFER are mapped
+   user memory.  The file system copies to and from BUFFER with
+   its locks held, so a bad buffer must be caught before. */
+static void
+check_buffer(const void *buffer, unsigned size)
+{
+	const uint8_t *start = buffer;
+	const uint8_t *end = start + size;
+	const uint8_t *p;
+
+	if(size == 0)
+		return;
+	if(end < start || !is_user_vaddr(end - 1))
+		s_exit(-1);
+	for(p = pg_round_down(start); p < end; p += PGSIZE)
+		if(pagedir_get_page(thread_current()->pagedir, p) == NULL)
+			s_exit(-1);
+}
+
+/* Returns the file open as FD in the running process, or a null
+   pointer if there is none. */
+static struct file *
+fd_file(int fd)
+{
+	if(fd < 3 || fd >= 131)
+		return NULL;
+	return thread_current()->file_list[fd];
+}
+
+bool
+s_chdir(const char *dir)
+{
+	if(dir == NULL)
+		s_exit(-1);
+	return filesys_chdir(dir);
+}
+
+bool
+s_mkdir(const char *dir)
+{
+	if(dir == NULL)
+		s_exit(-1);
+	return filesys_mkdir(dir);
+}
+
+bool
+s_readdir(int fd, char *name)
+{
+	struct file *of = fd_file(fd);
+	struct dir *dir;
+	bool success;
+
+	if(of == NULL || !inode_is_dir(file_get_inode(of)))
+		return false;
+	dir = dir_open(inode_reopen(file_get_inode(of)));
+	if(dir == NULL)
+		return false;
+	/* The directory position lives in the file's position. */
+	dir_seek(dir, file_tell(of));
+	success = dir_readdir(dir, name);
+	file_seek(of, dir_tell(dir));
+	dir_close(dir);
+	return success;
+}
+
+bool
+s_isdir(int fd)
+{
+	struct file *of = fd_file(fd);
+	return of != NULL && inode_is_dir(file_get_inode(of));
+}
+
+int
+s_inumber(int fd)
+{
+	struct file *of = fd_file(fd);
+	if(of == NULL)
+		return -1;
+	return inode_get_inumber(file_get_inode(of));
+}
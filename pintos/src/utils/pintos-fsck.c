@@ -0,0 +1,733 @@
+/* pintos-fsck: checks a Pintos file system disk image, such as
+   the fs.dsk used by the `pintos' script, and reports how its
+   files are laid out.
+
+   The on-disk structures below must match those in
+   filesys/inode.c, filesys/directory.c, filesys/free-map.c and
+   filesys/journal.c. */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTOR_SIZE 512
+
+/* System sectors. */
+#define FREE_MAP_SECTOR 0
+#define ROOT_DIR_SECTOR 1
+#define JOURNAL_SECTOR 2
+#define JOURNAL_SECTORS 127
+
+/* Inodes. */
+#define INODE_MAGIC 0x494e4f44
+#define INLINE_EXTENTS 41
+#define BLOCK_EXTENTS 42
+#define INODE_DIR 0x1
+#define INODE_INLINE 0x2
+
+struct extent
+  {
+    uint32_t block;                     /* First file block. */
+    uint32_t start;                     /* First disk sector. */
+    uint32_t length;                    /* Number of blocks. */
+  };
+
+#define INLINE_SIZE (INLINE_EXTENTS * (int32_t) sizeof (struct extent))
+
+struct inode_disk
+  {
+    union
+      {
+        struct extent extents[INLINE_EXTENTS];
+        uint8_t inline_data[INLINE_SIZE];
+      };
+    uint32_t ext_next;
+    uint32_t extent_cnt;
+    int32_t length;
+    uint32_t magic;
+    uint32_t flags;
+  };
+
+struct extent_block
+  {
+    struct extent extents[BLOCK_EXTENTS];
+    uint32_t next;
+    uint32_t unused[1];
+  };
+
+/* Directories. */
+#define DIR_MAGIC 0x44495248
+#define DIR_MAX_DEPTH 16
+#define NAME_MAX 14
+
+struct dir_header
+  {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t bucket_cnt;
+    uint32_t entry_cnt;
+    uint32_t parent;
+    uint32_t unused[3];
+  };
+
+struct dir_entry
+  {
+    uint32_t inode_sector;
+    char name[NAME_MAX + 1];
+    uint8_t in_use;
+    uint8_t unused[12];
+  };
+
+#define BUCKET_ENTRIES (SECTOR_SIZE / sizeof (struct dir_entry) - 1)
+struct dir_bucket
+  {
+    uint32_t depth;
+    uint32_t cnt;
+    uint8_t unused[24];
+    struct dir_entry entries[BUCKET_ENTRIES];
+  };
+
+#define TABLE_OFS ((uint32_t) sizeof (struct dir_header))
+#define BUCKET_BASE ((TABLE_OFS + (4u << DIR_MAX_DEPTH) + SECTOR_SIZE - 1) \
+                     / SECTOR_SIZE)
+
+/* Journal. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+struct journal_header
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t cnt;
+    uint32_t unused[125];
+  };
+
+/* The disk image. */
+static const char *disk_name;
+static uint8_t *disk;
+static uint32_t sector_cnt;
+
+/* Owner of each sector, as found by walking the tree: the inode
+   sector of the file it belongs to, or NO_OWNER. */
+#define NO_OWNER UINT32_MAX
+static uint32_t *owner;
+
+/* Free map read from the image. */
+static uint8_t *free_map;
+static uint32_t free_map_bytes;
+
+/* Directories visited, to catch cycles. */
+static uint8_t *visited;
+
+static bool verbose;
+static unsigned long error_cnt, warning_cnt;
+
+/* Layout statistics, over regular files and directories. */
+struct layout
+  {
+    unsigned long files, dirs;
+    unsigned long inlined;              /* Files with data in the inode. */
+    unsigned long placed;               /* Files with at least one block. */
+    unsigned long sectors;              /* Data sectors. */
+    unsigned long extents;
+    unsigned long fragmented;           /* Files with over one extent. */
+    unsigned long long inode_dist;      /* Sum of inode-to-data distances. */
+    unsigned long long gap_dist;        /* Sum of gaps between extents. */
+    unsigned long gap_cnt;
+  };
+static struct layout layout;
+
+/* An open file: its inode and full extent table. */
+struct file
+  {
+    uint32_t sector;
+    const char *path;
+    struct inode_disk inode;
+    struct extent *extents;
+    uint32_t extent_cnt;
+  };
+
+static void usage (int exit_code) __attribute__ ((noreturn));
+static void
+error (const char *msg, ...) __attribute__ ((format (printf, 1, 2)));
+static void
+warning (const char *msg, ...) __attribute__ ((format (printf, 1, 2)));
+
+/* Reports an inconsistency. */
+static void
+error (const char *msg, ...)
+{
+  va_list args;
+
+  printf ("error: ");
+  va_start (args, msg);
+  vprintf (msg, args);
+  va_end (args);
+  putchar ('\n');
+  error_cnt++;
+}
+
+/* Reports something suspect that does not lose data. */
+static void
+warning (const char *msg, ...)
+{
+  va_list args;
+
+  printf ("warning: ");
+  va_start (args, msg);
+  vprintf (msg, args);
+  va_end (args);
+  putchar ('\n');
+  warning_cnt++;
+}
+
+/* Returns sector SECTOR of the image. */
+static const void *
+sector_data (uint32_t sector)
+{
+  return disk + (size_t) sector * SECTOR_SIZE;
+}
+
+/* Records that SECTOR belongs to the file whose inode is at
+   INODE_SECTOR, complaining about sectors off the disk or
+   claimed twice. */
+static void
+claim (uint32_t sector, uint32_t inode_sector, const char *path)
+{
+  if (sector >= sector_cnt)
+    error ("%s: sector %u is past end of disk", path, sector);
+  else if (owner[sector] != NO_OWNER)
+    error ("%s: sector %u also belongs to inode %u",
+           path, sector, owner[sector]);
+  else
+    owner[sector] = inode_sector;
+}
+
+/* Returns true if the free map marks SECTOR in use. */
+static bool
+free_map_test (uint32_t sector)
+{
+  return (sector / 8 < free_map_bytes
+          && (free_map[sector / 8] >> (sector % 8)) & 1);
+}
+
+/* Reads the inode at SECTOR and its extent table into F,
+   claiming the inode and extent blocks.  Returns false if the
+   inode is unusable. */
+static bool
+file_open (struct file *f, uint32_t sector, const char *path)
+{
+  uint32_t i, cnt, block, next;
+
+  f->sector = sector;
+  f->path = path;
+  f->extents = NULL;
+  f->extent_cnt = 0;
+  if (sector >= sector_cnt)
+    {
+      error ("%s: inode sector %u is past end of disk", path, sector);
+      return false;
+    }
+  memcpy (&f->inode, sector_data (sector), sizeof f->inode);
+  if (f->inode.magic != INODE_MAGIC)
+    {
+      error ("%s: sector %u is not an inode", path, sector);
+      return false;
+    }
+  claim (sector, sector, path);
+  if (f->inode.length < 0)
+    error ("%s: negative length %d", path, f->inode.length);
+  if (f->inode.flags & INODE_INLINE)
+    {
+      if (f->inode.flags & INODE_DIR)
+        error ("%s: directory is marked inline", path);
+      if (f->inode.length > INLINE_SIZE)
+        error ("%s: inline file is %d bytes long", path, f->inode.length);
+      if (f->inode.extent_cnt != 0 || f->inode.ext_next != 0)
+        error ("%s: inline file has extents", path);
+      return true;
+    }
+
+  cnt = f->inode.extent_cnt;
+  f->extents = calloc (cnt > 0 ? cnt : 1, sizeof *f->extents);
+  if (f->extents == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", disk_name);
+      exit (2);
+    }
+  for (i = 0; i < cnt && i < INLINE_EXTENTS; i++)
+    f->extents[i] = f->inode.extents[i];
+  for (next = f->inode.ext_next; i < cnt; )
+    {
+      const struct extent_block *eb;
+      uint32_t j;
+
+      if (next == 0 || next >= sector_cnt)
+        {
+          error ("%s: extent chain ends after %u of %u extents",
+                 path, i, cnt);
+          cnt = i;
+          break;
+        }
+      claim (next, sector, path);
+      eb = sector_data (next);
+      for (j = 0; j < BLOCK_EXTENTS && i < cnt; j++)
+        f->extents[i++] = eb->extents[j];
+      next = eb->next;
+    }
+  f->extent_cnt = cnt;
+
+  /* Extents must be in block order, must not overlap, and must
+     lie within the file. */
+  for (i = 0, block = 0; i < cnt; i++)
+    {
+      const struct extent *e = &f->extents[i];
+      uint32_t j;
+
+      if (e->length == 0)
+        error ("%s: extent %u is empty", path, i);
+      if (e->block < block)
+        error ("%s: extent %u is out of order", path, i);
+      block = e->block + e->length;
+      if ((uint64_t) block * SECTOR_SIZE
+          >= (uint64_t) f->inode.length + SECTOR_SIZE)
+        warning ("%s: extent %u maps blocks past end of file", path, i);
+      if ((uint64_t) e->start + e->length > sector_cnt)
+        error ("%s: extent %u runs past end of disk", path, i);
+      else
+        for (j = 0; j < e->length; j++)
+          claim (e->start + j, sector, path);
+    }
+  return true;
+}
+
+static void
+file_close (struct file *f)
+{
+  free (f->extents);
+}
+
+/* Returns the sector holding block BLOCK of F, or 0 for a hole. */
+static uint32_t
+file_sector (const struct file *f, uint32_t block)
+{
+  uint32_t lo = 0, hi = f->extent_cnt;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      const struct extent *e = &f->extents[mid];
+      if (block < e->block)
+        hi = mid;
+      else if (block - e->block >= e->length)
+        lo = mid + 1;
+      else
+        return e->start + (block - e->block) < sector_cnt
+               ? e->start + (block - e->block) : 0;
+    }
+  return 0;
+}
+
+/* Reads SIZE bytes at OFS in F into BUFFER.  Holes and bytes past
+   end of file read as zeros. */
+static void
+file_read (const struct file *f, void *buffer_, uint32_t size, uint32_t ofs)
+{
+  uint8_t *buffer = buffer_;
+
+  if (f->inode.flags & INODE_INLINE)
+    {
+      uint32_t length = f->inode.length;
+      uint32_t n = ofs < length ? length - ofs : 0;
+      if (n > size)
+        n = size;
+      memcpy (buffer, f->inode.inline_data + ofs, n);
+      memset (buffer + n, 0, size - n);
+      return;
+    }
+
+  while (size > 0)
+    {
+      uint32_t sector_ofs = ofs % SECTOR_SIZE;
+      uint32_t chunk = SECTOR_SIZE - sector_ofs;
+      uint32_t sector = file_sector (f, ofs / SECTOR_SIZE);
+
+      if (chunk > size)
+        chunk = size;
+      if (sector != 0 && ofs < (uint32_t) f->inode.length)
+        memcpy (buffer, (const uint8_t *) sector_data (sector) + sector_ofs,
+                chunk);
+      else
+        memset (buffer, 0, chunk);
+      buffer += chunk;
+      ofs += chunk;
+      size -= chunk;
+    }
+}
+
+/* Adds F's layout to the statistics and, if verbose, prints it. */
+static void
+file_layout (const struct file *f)
+{
+  unsigned long sectors = 0;
+  unsigned long long gaps = 0;
+  uint32_t inode_dist = 0;
+  uint32_t i;
+
+  if (f->inode.flags & INODE_DIR)
+    layout.dirs++;
+  else
+    layout.files++;
+  if (f->inode.flags & INODE_INLINE)
+    layout.inlined++;
+  for (i = 0; i < f->extent_cnt; i++)
+    {
+      const struct extent *e = &f->extents[i];
+      sectors += e->length;
+      if (i > 0)
+        {
+          uint32_t end = f->extents[i - 1].start + f->extents[i - 1].length;
+          gaps += e->start > end ? e->start - end : end - e->start;
+        }
+    }
+  if (f->extent_cnt > 0)
+    {
+      uint32_t first = f->extents[0].start;
+      inode_dist = first > f->sector ? first - f->sector : f->sector - first;
+      layout.placed++;
+      layout.inode_dist += inode_dist;
+      layout.gap_dist += gaps;
+      layout.gap_cnt += f->extent_cnt - 1;
+      if (f->extent_cnt > 1)
+        layout.fragmented++;
+    }
+  layout.sectors += sectors;
+  layout.extents += f->extent_cnt;
+
+  if (verbose)
+    printf ("%-32s %4s %7u %10d %7lu %7u %9u %9llu\n",
+            f->path, (f->inode.flags & INODE_DIR ? "dir"
+                      : f->inode.flags & INODE_INLINE ? "inl" : "file"),
+            f->sector,
+            f->inode.length, sectors, f->extent_cnt, inode_dist, gaps);
+}
+
+/* Returns the hash of NAME, as hash_string() in lib/kernel/hash.c
+   computes it. */
+static uint32_t
+name_hash (const char *name)
+{
+  const unsigned char *s = (const unsigned char *) name;
+  uint32_t hash = 2166136261u;
+
+  while (*s != '\0')
+    hash = (hash * 16777619u) ^ *s++;
+  return hash;
+}
+
+static void check_file (uint32_t sector, uint32_t parent, const char *path,
+                        bool want_dir);
+
+/* Checks directory F, whose parent directory's inode is at
+   PARENT, and everything in it. */
+static void
+check_dir (const struct file *f, uint32_t parent)
+{
+  struct dir_header h;
+  uint32_t *table;
+  uint32_t table_size, b, i, entry_cnt = 0;
+
+  file_read (f, &h, sizeof h, 0);
+  if (h.magic != DIR_MAGIC)
+    {
+      error ("%s: directory header is damaged", f->path);
+      return;
+    }
+  if (h.parent != parent)
+    error ("%s: parent is inode %u, not %u", f->path, h.parent, parent);
+  if (h.depth > DIR_MAX_DEPTH)
+    {
+      error ("%s: bucket table depth %u is too large", f->path, h.depth);
+      return;
+    }
+
+  table_size = 1u << h.depth;
+  table = malloc (table_size * sizeof *table);
+  if (table == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", disk_name);
+      exit (2);
+    }
+  file_read (f, table, table_size * sizeof *table, TABLE_OFS);
+  for (i = 0; i < table_size; i++)
+    if (table[i] >= h.bucket_cnt)
+      {
+        error ("%s: bucket table entry %u names bucket %u of %u",
+               f->path, i, table[i], h.bucket_cnt);
+        table[i] = 0;
+      }
+
+  for (b = 0; b < h.bucket_cnt; b++)
+    {
+      struct dir_bucket bucket;
+      uint32_t used = 0, refs = 0;
+
+      file_read (f, &bucket, sizeof bucket,
+                 (BUCKET_BASE + b) * SECTOR_SIZE);
+      if (bucket.depth > h.depth)
+        error ("%s: bucket %u is deeper than its table", f->path, b);
+      for (i = 0; i < table_size; i++)
+        if (table[i] == b)
+          refs++;
+      if (bucket.depth <= h.depth && refs != 1u << (h.depth - bucket.depth))
+        error ("%s: bucket %u has %u table entries, not %u",
+               f->path, b, refs, 1u << (h.depth - bucket.depth));
+
+      for (i = 0; i < BUCKET_ENTRIES; i++)
+        {
+          struct dir_entry *e = &bucket.entries[i];
+          char *path;
+
+          if (!e->in_use)
+            continue;
+          used++;
+          if (memchr (e->name, '\0', sizeof e->name) == NULL
+              || e->name[0] == '\0')
+            {
+              error ("%s: bucket %u entry %u has a bad name", f->path, b, i);
+              continue;
+            }
+          if (table[name_hash (e->name) & (table_size - 1)] != b)
+            error ("%s/%s: entry is in the wrong bucket", f->path, e->name);
+
+          path = malloc (strlen (f->path) + strlen (e->name) + 2);
+          if (path == NULL)
+            {
+              fprintf (stderr, "%s: out of memory\n", disk_name);
+              exit (2);
+            }
+          sprintf (path, "%s/%s", strcmp (f->path, "/") ? f->path : "",
+                   e->name);
+          check_file (e->inode_sector, f->sector, path, false);
+          free (path);
+        }
+      if (used != bucket.cnt)
+        error ("%s: bucket %u counts %u entries but holds %u",
+               f->path, b, bucket.cnt, used);
+      entry_cnt += used;
+    }
+  if (entry_cnt != h.entry_cnt)
+    error ("%s: header counts %u entries but directory holds %u",
+           f->path, h.entry_cnt, entry_cnt);
+  free (table);
+}
+
+/* Checks the file or directory whose inode is at SECTOR, whose
+   directory's inode is at PARENT.  WANT_DIR is true for the root
+   directory, which has to be a directory. */
+static void
+check_file (uint32_t sector, uint32_t parent, const char *path,
+            bool want_dir)
+{
+  struct file f;
+
+  if (sector < sector_cnt && visited[sector])
+    {
+      error ("%s: inode %u is linked more than once", path, sector);
+      return;
+    }
+  if (!file_open (&f, sector, path))
+    return;
+  visited[sector] = 1;
+  if (want_dir && !(f.inode.flags & INODE_DIR))
+    error ("%s: is not a directory", path);
+
+  file_layout (&f);
+  if (f.inode.flags & INODE_DIR)
+    check_dir (&f, parent);
+  file_close (&f);
+}
+
+/* Reads the free map file into free_map. */
+static void
+read_free_map (void)
+{
+  struct file f;
+
+  if (!file_open (&f, FREE_MAP_SECTOR, "[free map]"))
+    {
+      fprintf (stderr, "%s: cannot read free map\n", disk_name);
+      exit (1);
+    }
+  free_map_bytes = (sector_cnt + 31) / 32 * 4;
+  if ((uint32_t) f.inode.length != free_map_bytes)
+    error ("[free map]: %d bytes long, not %u",
+           f.inode.length, free_map_bytes);
+  free_map = malloc (free_map_bytes);
+  if (free_map == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", disk_name);
+      exit (2);
+    }
+  file_read (&f, free_map, free_map_bytes, 0);
+  file_close (&f);
+}
+
+/* Reports whether the journal has a transaction to replay. */
+static void
+check_journal (void)
+{
+  const struct journal_header *h = sector_data (JOURNAL_SECTOR);
+  uint32_t i;
+
+  if (h->magic != JOURNAL_MAGIC)
+    error ("journal header is damaged");
+  else if (h->cnt != 0)
+    warning ("journal holds %u sectors to replay; "
+             "boot the disk once to replay them", h->cnt);
+  for (i = 0; i < JOURNAL_SECTORS; i++)
+    claim (JOURNAL_SECTOR + i, JOURNAL_SECTOR, "[journal]");
+}
+
+/* Compares the sectors found in use with the free map, and
+   reports the free space's fragmentation. */
+static void
+check_free_map (void)
+{
+  unsigned long free_cnt = 0, run_cnt = 0, run = 0, longest = 0;
+  unsigned long leaked = 0;
+  uint32_t sector;
+
+  for (sector = 0; sector < sector_cnt; sector++)
+    {
+      bool used = free_map_test (sector);
+
+      if (owner[sector] != NO_OWNER && !used)
+        error ("sector %u belongs to inode %u but is marked free",
+               sector, owner[sector]);
+      else if (owner[sector] == NO_OWNER && used)
+        leaked++;
+
+      if (!used)
+        {
+          free_cnt++;
+          if (run++ == 0)
+            run_cnt++;
+          if (run > longest)
+            longest = run;
+        }
+      else
+        run = 0;
+    }
+  if (leaked > 0)
+    warning ("%lu sectors are marked in use but belong to nothing", leaked);
+
+  printf ("Free space: %lu sectors in %lu runs, longest %lu, "
+          "mean %.1f\n", free_cnt, run_cnt, longest,
+          run_cnt > 0 ? (double) free_cnt / run_cnt : 0.0);
+}
+
+/* Prints the layout statistics. */
+static void
+print_layout (void)
+{
+  unsigned long cnt = layout.files + layout.dirs;
+
+  printf ("Files: %lu files (%lu inline), %lu directories, "
+          "%lu data sectors in %lu extents\n",
+          layout.files, layout.inlined, layout.dirs, layout.sectors,
+          layout.extents);
+  printf ("Fragmentation: %.2f extents per file, "
+          "%lu files in more than one extent\n",
+          cnt > 0 ? (double) layout.extents / cnt : 0.0,
+          layout.fragmented);
+  printf ("Locality: mean %.1f sectors from inode to data, "
+          "mean %.1f sectors between extents\n",
+          layout.placed > 0 ? (double) layout.inode_dist / layout.placed : 0.0,
+          layout.gap_cnt > 0 ? (double) layout.gap_dist / layout.gap_cnt : 0.0);
+}
+
+static void
+usage (int exit_code)
+{
+  printf ("pintos-fsck, a checker for Pintos file system disks\n"
+          "Usage: pintos-fsck [-v] DISKFILE\n"
+          "where DISKFILE is the file system disk, usually fs.dsk.\n"
+          "Options:\n"
+          "  -v                Print the layout of every file.\n"
+          "  -h                Display this help message.\n"
+          "Exits with status 1 if errors are found.\n");
+  exit (exit_code);
+}
+
+int
+main (int argc, char *argv[])
+{
+  FILE *file;
+  long size;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "vh")) != -1)
+    switch (opt)
+      {
+      case 'v':
+        verbose = true;
+        break;
+      case 'h':
+        usage (0);
+      default:
+        usage (2);
+      }
+  if (optind != argc - 1)
+    usage (2);
+  disk_name = argv[optind];
+
+  /* Read the whole image. */
+  file = fopen (disk_name, "rb");
+  if (file == NULL || fseek (file, 0, SEEK_END) != 0
+      || (size = ftell (file)) < 0 || fseek (file, 0, SEEK_SET) != 0)
+    {
+      fprintf (stderr, "%s: %s\n", disk_name, strerror (errno));
+      return 2;
+    }
+  sector_cnt = size / SECTOR_SIZE;
+  if (sector_cnt < JOURNAL_SECTOR + JOURNAL_SECTORS)
+    {
+      fprintf (stderr, "%s: too small to hold a file system\n", disk_name);
+      return 2;
+    }
+  disk = malloc ((size_t) sector_cnt * SECTOR_SIZE);
+  owner = malloc ((size_t) sector_cnt * sizeof *owner);
+  visited = calloc (sector_cnt, 1);
+  if (disk == NULL || owner == NULL || visited == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", disk_name);
+      return 2;
+    }
+  if (fread (disk, SECTOR_SIZE, sector_cnt, file) != sector_cnt)
+    {
+      fprintf (stderr, "%s: read error\n", disk_name);
+      return 2;
+    }
+  fclose (file);
+  memset (owner, 0xff, (size_t) sector_cnt * sizeof *owner);
+
+  printf ("%s: %u sectors\n", disk_name, sector_cnt);
+  check_journal ();
+  read_free_map ();
+  if (verbose)
+    printf ("%-32s %4s %7s %10s %7s %7s %9s %9s\n", "PATH", "TYPE",
+            "INODE", "LENGTH", "SECTORS", "EXTENTS", "INODE-GAP",
+            "EXT-GAPS");
+  check_file (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR, "/", true);
+  print_layout ();
+  check_free_map ();
+
+  printf ("%lu errors, %lu warnings\n", error_cnt, warning_cnt);
+  return error_cnt > 0;
+}